@@ -3,10 +3,11 @@
  * Copyright (c) 2022 mini-rose
  */
 
-#define _XOPEN_SOURCE 500
+#define _XOPEN_SOURCE 700
 #include <sys/stat.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <limits.h>
 #include <unistd.h>
 #include <string.h>
@@ -22,8 +23,9 @@
 # define get_nprocs()   8
 #endif
 
-/* The maximum amount of threads that can be launched. */
-#define MAX_PROCS       64
+#if __APPLE__
+# define st_mtim        st_mtimespec
+#endif
 
 /* Version integer. This is shown when -v is passed. */
 #define BUILD_VERSION   11
@@ -32,6 +34,8 @@
 #define BUILD_DIR       "builddir"
 #define BUILD_OUT       "program"
 #define BUILD_CC        "c99"
+#define BUILD_AR        "ar"
+#define BUILD_CACHESIZE "5G"
 
 /* RSD 10/2a: provide at least a 4095 char line buffer */
 #define LINESIZE        4096
@@ -46,7 +50,12 @@
 #define EXIT_BUILDFILE  2           /* buildfile not found */
 #define EXIT_POPEN      3           /* popen failed */
 #define EXIT_TARGET     4           /* unknown target */
-#define EXIT_THREAD     5           /* failed to create thread */
+#define EXIT_THREAD     5           /* failed to create a process */
+#define EXIT_COMPILE    6           /* compiling or linking failed */
+#define EXIT_RUN        7           /* a target failed */
+
+/* Initial value for the hash_* functions. */
+#define HASH_INIT       0xcbf29ce484222325ULL
 
 
 struct strlist
@@ -59,9 +68,87 @@ struct strlist
 struct target
 {
 	struct strlist cmds;
+	struct strlist needs;           /* targets to run before this one */
+	char name[];
+};
+
+/* An artifact section in the buildfile: another output, built from its
+   own sources, with its own flags & libraries added to the global ones. */
+struct artifact
+{
+	struct strlist sources;         /* src */
+	struct strlist flags;           /* flags */
+	struct strlist libraries;       /* libs */
+	struct strlist needs;           /* needs */
+	char *out;                      /* out, default: the name */
+	char *kind;                     /* kind */
+	char name[];
+};
+
+enum cc_family
+{
+	CC_UNKNOWN = -1,
+	CC_OTHER,
+	CC_GCC,
+	CC_CLANG
+};
+
+/* A variant section in the buildfile: all outputs built once more, with
+   another compiler or more flags, into their own directories. */
+struct variant
+{
+	char *cc;                       /* cc, default: the global one */
+	struct strlist flags;           /* flags, after the global ones */
+	char *out;                      /* out, default: name/out */
+	char *builddir;                 /* builddir, default: builddir/name */
+	uint64_t cchash;                /* of its cc, once compiled */
+	enum cc_family ccfamily;
 	char name[];
 };
 
+/* What the objects of an output are linked into. */
+enum output_kind
+{
+	OUTPUT_UNKNOWN = -1,
+	OUTPUT_EXECUTABLE,
+	OUTPUT_STATIC,                  /* ar archive */
+	OUTPUT_THIN,                    /* thin archive, only naming the objects */
+	OUTPUT_SHARED
+};
+
+/* How the objects are optimized together when linking. */
+enum lto_mode
+{
+	LTO_UNKNOWN = -1,
+	LTO_OFF,
+	LTO_THIN,                       /* in parallel, with a cache */
+	LTO_FULL                        /* the whole program at once */
+};
+
+/* What --stats counts. */
+enum stat_counter
+{
+	STAT_SPAWNED,                   /* processes started */
+	STAT_CMDBYTES,                  /* bytes of their command lines */
+	STAT_ALLOCS,                    /* allocations in the strlist functions */
+	STAT_NCOUNTERS
+};
+
+/* A machine running `build -W`, which compiles for us. */
+struct worker
+{
+	char *addr;                     /* host:port, or the path of a socket */
+	int slots;                      /* jobs it runs at once */
+};
+
+/* Limits for starting another job, 0 means no limit. */
+struct limits
+{
+	double load;                    /* 1 minute load average */
+	long long mem;                  /* bytes for all running jobs */
+	double pressure;                /* memory pressure in % (PSI avg10) */
+};
+
 struct config
 {
 	struct strlist sources;         /* src */
@@ -69,15 +156,43 @@ struct config
 	struct strlist libraries;       /* libs */
 	char *buildfile;                /* -f */
 	char *builddir;                 /* builddir */
+	char *topbuilddir;              /* builddir of the buildfile, or NULL */
 	char *cc;                       /* cc */
 	char *out;                      /* out */
+	char *kind;                     /* kind */
+	char *ar;                       /* ar */
+	char *lto;                      /* lto */
+	char *cache;                    /* cache */
+	char *cachesize_str;            /* cachesize */
+	long long cachesize;
+	char *maxload_str;              /* maxload, -l */
+	char *maxmem_str;               /* maxmem, -m */
+	char *maxpressure_str;          /* maxpressure, -p */
+	char *pch;                      /* pch */
+	struct strlist pchflags;        /* flags using the precompiled pch */
+	struct strlist pchinputs;       /* headers the pch is built from */
+	char *unity;                    /* unity */
+	struct strlist unityexclude;    /* unityexclude */
+	struct strlist workers;         /* workers */
+	struct limits limits;
 	bool explain;                   /* -e */
 	bool only_setup;                /* -s */
+	bool watch;                     /* -w */
 	bool user_sources;
 	int use_n_threads;              /* -j */
+	int njobs;                      /* -j, or from the jobserver */
+	uint64_t cchash;                /* compiler identity */
+	enum cc_family ccfamily;
 	struct strlist called_targets;
 	struct target **targets;
 	size_t ntargets;
+	struct artifact **artifacts;
+	size_t nartifacts;
+	struct variant **variants;
+	size_t nvariants;
+	struct strlist called_variants; /* -V */
+	char *name;                     /* of the artifact, or NULL */
+	char *variant;                  /* of the variant, or NULL */
 };
 
 enum field_type_e
@@ -86,6 +201,9 @@ enum field_type_e
 	FIELD_STRLIST
 };
 
+/* The most options a buildfile can have. */
+#define CONFIG_MAXFIELDS    32
+
 struct config_field
 {
 	const char *name;
@@ -94,12 +212,104 @@ struct config_field
 	const char *default_val;
 };
 
-struct thread_task
+/* A hash table mapping strings to integers. Zero-initialize to use. */
+struct strmap_entry
+{
+	char *key;
+	uint64_t val;
+};
+
+struct strmap
+{
+	struct strmap_entry *slots;
+	size_t size;
+	size_t used;
+};
+
+/* The build state of a single object file, kept next to the object in the
+   build directory as "<object>.state". */
+struct objstate
+{
+	uint64_t cmdhash;               /* hash of the compile command */
+	uint64_t cchash;                /* compiler identity */
+	struct strlist inputs;          /* files the object is built from */
+	int64_t *mtimes;                /* mtime of each input in ns */
+	double time;                    /* last compile time in seconds */
+	long rss;                       /* peak memory of the compiler in KiB */
+	uint64_t objhash;               /* contents of the output, 0 if unknown */
+	int64_t objmtime;               /* mtime of the output in ns */
+};
+
+/* A glob pattern split into its path segments. */
+struct glob
+{
+	struct strlist segs;
+	char *kinds;                    /* literal, wildcard or "**" */
+	char *head;                     /* fixed text the pattern starts with */
+	char *tail;                     /* fixed text the last segment ends with */
+	bool basename;                  /* no slash, matches the name anywhere */
+	bool dir;                       /* ended with a slash */
+};
+
+/* Patterns for excluding many paths. Plain paths & directories are looked
+   up in the tables, the rest is matched one by one. Zero-initialize to
+   use. */
+struct globset
+{
+	struct strmap paths;
+	struct strmap dirs;
+	struct glob *globs;
+	size_t nglobs;
+};
+
+/* Files with a name matching `name` anywhere below `dir`, or with a path
+   matching `glob` if it is set. */
+struct walk_pattern
 {
-	struct config *config;
-	int tid;
-	int from;
-	int to;
+	char *dir;
+	char *name;
+	struct glob *glob;
+	struct strlist results;
+};
+
+/* How a process ran, filled in by proc_wait(). */
+struct proc_result
+{
+	pid_t pid;
+	int slot;                       /* job slot, set by jobs_run() */
+	int status;                     /* exit code, or 128 + signal */
+	double start;                   /* clock_now() when started */
+	double wall;                    /* seconds */
+	double cpu;                     /* user + system seconds */
+	long maxrss;                    /* peak memory in KiB */
+};
+
+/* A queue of jobs, run by jobs_run() on at most `nslots` processes at
+   once. The jobs are started in order, as soon as they are ready. */
+struct jobqueue
+{
+	size_t njobs;
+	int nslots;
+	int nremote;                    /* slots running jobs elsewhere */
+	int failed;
+	void *data;
+
+	/* Start the job, returns the pid of the spawned process. If the job
+	   finished without a process, return 0. On failure return -1. */
+	pid_t (*start)(struct jobqueue *queue, size_t job, int slot);
+
+	/* Called after the process of the job exited. */
+	void (*finish)(struct jobqueue *queue, size_t job,
+			struct proc_result *res);
+
+	/* Optional, returns false if the job should not be started yet next to
+	   the `nrunning` jobs in `running`. It is checked again later. */
+	bool (*admit)(struct jobqueue *queue, size_t job, size_t *running,
+			int nrunning);
+
+	/* Optional, returns 1 if the job can be started, 0 if it has to wait
+	   for other jobs to finish, or -1 if it can never be started. */
+	int (*ready)(struct jobqueue *queue, size_t job);
 };
 
 
@@ -115,16 +325,80 @@ void resolve_buildpath(struct config *config);
    removed from the filename list. */
 void remove_excluded(struct strlist *filenames);
 
-/* Put the filenames into `output` from "find . -type `type` -name `name`."
-   Returns the amount of files found. */
-int find(struct strlist *output, char type, char *dir, char *name);
+/* Put the regular files below `dir` matching the `name` pattern into
+   `output`, like "find `dir` -type f -name `name`" but sorted. Returns the
+   amount of files found. */
+int find(struct strlist *output, char *dir, char *name);
+
+/* Find all regular files matching any of the patterns, walking each
+   directory only once. The results of each pattern are sorted. The dir,
+   name & glob must be allocated, and are owned by the pattern. Directories
+   matching `exclude` are not entered, if it is set. */
+void walk(struct walk_pattern *patterns, size_t n, struct globset *exclude);
+void walk_pattern_free(struct walk_pattern *pattern);
+
+/* Record the mtime of every directory the walker reads into `dirs`, until
+   called with NULL. */
+void walk_record(struct strmap *dirs);
+
+/* Returns true if the string has any of the glob characters "*?[". */
+bool is_glob(const char *str);
+
+/* Compile the pattern. "*", "?" and classes like "[a-z]" match within a
+   path segment, "**" matches any amount of directories. */
+void glob_compile(struct glob *glob, const char *pattern);
+bool glob_match(struct glob *glob, const char *path);
+
+/* Returns true if a file below `dir` could match the glob. */
+bool glob_match_below(struct glob *glob, const char *dir);
+
+/* Returns the literal directory the glob starts with, or ".". */
+char *glob_root(struct glob *glob);
+void glob_free(struct glob *glob);
+
+/* Add a pattern to the set: a path, a directory ending with "/", or a
+   glob. */
+void globset_add(struct globset *set, const char *pattern);
+
+/* Returns true if the file is excluded by the set, or is in an excluded
+   directory. */
+bool globset_match(struct globset *set, const char *path);
+bool globset_match_dir(struct globset *set, const char *dir);
+void globset_free(struct globset *set);
 
 /* Recursively remove the directory at the given path. Same as rm -rf `path`. */
 void removedir(char *path);
 
+/* Create the directory and all of its parents. Same as mkdir -p `path`.
+   Returns 0 on success, 1 on failure. */
+int mkdir_p(char *path);
+
+/* Make the file at `to` have the contents of `from`, by a hardlink if
+   possible, otherwise by a reflink or a regular copy. Returns 0 on success. */
+int clone_file(char *from, char *to);
+
+/* Like clone_file(), but `to` never shares the inode with `from`. */
+int copy_file(char *from, char *to);
+
+/* Write the contents of the file to `out`, if it exists. */
+void cat_file(char *path, FILE *out);
+
 /* Parse the buildfile. Name and data are pointed by `config`. */
 int parse_buildfile(struct config *config);
 
+/* Fill `fields` with the options of the buildfile, pointing into `config`.
+   Returns the amount of fields. */
+size_t buildfile_fields(struct config *config, struct config_field *fields);
+
+/* Load the parsed config from the snapshot in the build directory, if the
+   buildfile and the directories searched for sources are unchanged since
+   it was saved. Returns 0 on success. */
+int snapshot_load(struct config *config);
+
+/* Save the parsed config, which is valid while the directories in `dirs`
+   keep their mtimes. */
+void snapshot_save(struct config *config, struct strmap *dirs);
+
 void config_free(struct config *config);
 void config_dump(struct config *config);
 
@@ -141,10 +415,53 @@ int config_add_target_command(struct config *config, char *target, char *cmd);
    if it's found. Otherwise, returns INVALID_INDEX. */
 size_t config_find_target(struct config *config, char *name);
 
+/* Returns the commands of the target at `index` joined into a single shell
+   command. */
+char *config_target_command(struct config *config, size_t index);
+
 /* Runs the given target. If the target is not found, return 1. Otherwise
    return 0. */
 int config_call_target(struct config *config, char *name);
 
+/* Run the targets & everything they need, in parallel where they don't
+   depend on each other. Each target runs once. The name "compile" stands
+   for compiling & linking, unless there is a target called like that.
+   Returns the amount of failed targets, or -1 if a target is unknown or
+   needs itself. */
+int targets_run(struct config *config, struct strlist *names);
+
+/* Add a new artifact section to the config. */
+struct artifact *config_add_artifact(struct config *config, char *name);
+
+/* Returns the index of the artifact, or INVALID_INDEX. */
+size_t config_find_artifact(struct config *config, char *name);
+
+/* Set up `out` as the config for building the artifact, or the main output
+   if `artifact` is NULL. It shares all global options with `config`, so
+   free it with config_artifact_free(). */
+void config_artifact(struct config *config, struct artifact *artifact,
+		struct config *out);
+void config_artifact_free(struct config *config);
+
+/* Add a new variant section to the config. */
+struct variant *config_add_variant(struct config *config, char *name);
+
+/* Returns the index of the variant, or INVALID_INDEX. */
+size_t config_find_variant(struct config *config, char *name);
+
+/* Set up `out` as the config of the variant, to pass to config_artifact()
+   for each of its outputs. Free it with config_artifact_free(). */
+void config_variant(struct config *config, struct variant *variant,
+		struct config *out);
+
+/* Returns true if the path is in the build directory of the buildfile, of
+   the config or of a variant, where the generated sources are. */
+bool config_in_builddir(struct config *config, char *path);
+
+/* Returns the kind of the output, from the kind option or else the name of
+   the output, or OUTPUT_UNKNOWN if the option has an unknown value. */
+enum output_kind output_kind(struct config *config);
+
 /* Returns true if `c` is a space or tab. */
 bool iswhitespace(char c);
 
@@ -160,6 +477,9 @@ size_t linelen(char *line);
    the string. If the operation fails, NULL is returned. */
 char *strlist_append(struct strlist *list, char *str);
 
+/* Works like strlist_append, but formats the string like printf. */
+char *strlist_appendf(struct strlist *list, const char *fmt, ...);
+
 /* Free all memory allocated in `list`. Sets all values of `list` to 0, making
    it reusable. */
 void strlist_free(struct strlist *list);
@@ -178,6 +498,270 @@ int strsplit(struct strlist *list, char *str);
 /* Replaces `from` chars to `to` chars. Returns the amount of chars replaced. */
 int strreplace(char *str, char from, char to);
 
-void compile(struct config *config);
+/* Make sure the string list is followed by a NULL pointer, so it can be
+   used as an argv array. Returns the array. */
+char **strlist_terminate(struct strlist *list);
+
+/* Returns a new string with all strings joined by `sep`. */
+char *strlist_join(struct strlist *list, char *sep);
+
+/* Parse a size in bytes with an optional K, M, G or T suffix. */
+long long parse_size(char *str);
+
+/* Run all jobs in the queue. Returns the amount of failed jobs. */
+int jobs_run(struct jobqueue *queue);
+
+/* Returns the time of a monotonic clock in seconds. */
+double clock_now(void);
+
+/* Returns true if the compiler, the flags or the libraries contain
+   characters which have a special meaning in a shell, so the commands using
+   them have to run through it. */
+bool needs_shell(struct config *config);
+
+/* Start the program in a child process with posix_spawn, searching for it
+   in PATH. If `errlog` is set, stderr is redirected into that file. Returns
+   the pid, or -1 on failure. */
+pid_t spawn_argv(char **argv, char *errlog);
+
+/* Like spawn_argv(), with stdout redirected into `output` if it is set. */
+pid_t spawn_redirect(char **argv, char *output, char *errlog);
+
+/* If the command is too long to start safely, write the arguments from
+   `first` up to `last` into the response file at `path`, and put the command
+   reading them with "@path" into `out`. Returns false if the command is
+   short enough, or the file cannot be written. */
+bool rspfile_args(struct strlist *argv, size_t first, size_t last,
+		char *path, struct strlist *out);
+
+/* Start `cmd` with /bin/sh in a child process. */
+pid_t spawn_shell(char *cmd, char *errlog);
+
+/* Start the command directly, or joined with spaces through the shell if
+   `shell` is set. */
+pid_t spawn_cmd(struct strlist *argv, bool shell, char *errlog);
+
+/* Wait for the process to exit and fill in `res`, which must have the
+   start time set. Returns false if `block` is not set and the process is
+   still running. */
+bool proc_wait(pid_t pid, bool block, struct proc_result *res);
+
+/* Run the command or shell command and wait for it. Returns the exit
+   status. */
+int run_cmd(struct strlist *argv, bool shell, struct proc_result *res);
+int run_shell(char *cmd, struct proc_result *res);
+
+/* Compile all out of date sources and link them. Returns 0 on success,
+   otherwise the amount of failed commands. */
+int compile(struct config *config);
+
+/* Build, and then build again whenever a source, header or the buildfile
+   changes. Only returns if watching is not possible. */
+int watch(struct config *config);
+
+/* Remember how to start this binary again, for the remote helpers. */
+void remote_init(char *argv0);
+
+/* Ask the workers from BUILD_WORKERS or the workers option how many jobs
+   they take. Returns the amount of the ones that answered. */
+size_t remote_probe(struct config *config, struct worker **workers);
+void remote_free(struct worker *workers, size_t n);
+
+/* Put the command into `argv`, which preprocesses the source here with the
+   `preprocess` command, and compiles it with `compile` on the worker at
+   `addr`, or here if the worker fails. */
+void remote_command(char *addr, char *source, char *object,
+		struct strlist *preprocess, struct strlist *compile,
+		struct strlist *argv);
+
+/* The helper started by remote_command(), run as "build --remote". */
+int remote_main(int argc, char **argv);
+
+/* Listen on `addr` and compile for other builds, with `slots` jobs at once
+   (default: cpu count), running only the compilers in `cc`. Only returns
+   on failure. */
+int worker_run(char *addr, int slots, struct strlist *cc);
+
+/* Prepare the object cache, if the cache option is set. */
+void cache_init(struct config *config);
+
+/* Returns the cache key for compiling `source` with `cmd`, or 0 if the key
+   cannot be computed. Compilers without depfiles are keyed by the output of
+   cache_preprocess() in `preprocessed` instead of the source. */
+uint64_t cache_key(struct config *config, char *source, char *cmd,
+		char *preprocessed);
+
+/* Start preprocessing the source into `output`, for the cache key. Returns
+   the pid, or -1. Only an exit status of 0 leaves a complete output. */
+pid_t cache_preprocess(struct config *config, char *source, char *output);
+
+/* Returns true if the key has an entry for the current headers, without
+   fetching it. */
+bool cache_contains(struct config *config, uint64_t key);
+
+/* Look up the key in the cache. On a hit, the object is put in place, the
+   saved warnings are printed and the inputs are added to `state`. */
+bool cache_fetch(struct config *config, uint64_t key, char *source,
+		char *object, struct objstate *state);
+
+/* Store a freshly compiled object, along with its warnings in `log`. The
+   `state` must list the source and all headers. */
+void cache_store(struct config *config, uint64_t key, char *object,
+		char *log, struct objstate *state);
+
+/* Update the statistics and evict old entries over the size limit. */
+void cache_finish(struct config *config);
+
+/* Continue the 64-bit FNV-1a `hash` with the given data. Start with
+   HASH_INIT. */
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t len);
+uint64_t hash_str(uint64_t hash, const char *str);
+
+/* Hash the contents of the file at `path` into `hash`. Returns 0 on success,
+   otherwise 1. */
+int hash_file(uint64_t *hash, const char *path);
+
+/* Find the value for `key` and put it into `val`. Returns false if the key
+   is not in the map. */
+bool strmap_get(struct strmap *map, const char *key, uint64_t *val);
+
+/* Set the value for `key`, the key is copied. */
+void strmap_set(struct strmap *map, const char *key, uint64_t val);
+void strmap_free(struct strmap *map);
+
+/* Returns a new string with the path of the object file for `source` in the
+   build directory, ending with `ext`. */
+char *object_path(struct config *config, char *source, const char *ext);
+
+/* Returns the mtime of the file in nanoseconds, or -1 if it does not
+   exist. */
+int64_t file_mtime(char *path);
+
+/* Returns the current time of the clock files are stamped with, in
+   nanoseconds. */
+int64_t file_clock(void);
+
+/* Join the jobserver of a parent make or build advertised in MAKEFLAGS, or
+   start our own for the commands we run. Returns the amount of jobs to
+   run at once. */
+int jobserver_init(struct config *config);
+
+/* Take a token for starting another job, without blocking. Returns false
+   if there is none right now. Always succeeds without a jobserver. */
+bool jobserver_acquire(void);
+
+/* Give back the token taken last. */
+void jobserver_release(void);
+
+/* Returns the descriptor to poll for tokens, or -1. */
+int jobserver_fd(void);
+
+/* Returns true if there is a jobserver our children can take tokens from. */
+bool jobserver_enabled(void);
+
+/* Precompile the header from the pch option, if it changed, and set up
+   the flags using it. Without a pch or on failure, nothing is set. */
+void pch_prepare(struct config *config);
+
+/* In unity mode, replace the sources with batches including them. */
+void unity_prepare(struct config *config);
+
+/* Returns the mode from the lto option, or LTO_UNKNOWN if it has an unknown
+   value. */
+enum lto_mode lto_mode(struct config *config);
+
+/* Returns true if the lto option is on, and the compiler supports it. */
+bool lto_enabled(struct config *config);
+
+/* Add the LTO flags to the flags of the output, which are used both for
+   compiling and linking, and create the cache directory. */
+void lto_prepare(struct config *config);
+
+/* Add the linker flags for LTO, like the cache directory. */
+void lto_link_flags(struct config *config, struct strlist *argv);
+
+/* Add the amount of code generation jobs to a link command. They are kept
+   out of the recorded command, so changing -j does not relink. Returns the
+   jobserver tokens taken for them, to be released after the link. */
+int lto_link_jobs(struct config *config, struct strlist *argv);
+
+/* Returns the archiver for the objects, which must understand the LTO
+   objects to index their symbols. */
+char *lto_archiver(struct config *config);
+
+/* Parse the limits from the config. */
+void limits_init(struct config *config);
+
+/* Returns true if a job with the predicted peak memory `rss` in KiB may be
+   started next to the running processes, with their predicted peak memory
+   in `running_rss`. Always true if nothing is running. */
+bool limits_admit(struct config *config, long rss, pid_t *running,
+		long *running_rss, int nrunning);
+void limits_free(void);
+
+/* Returns a hash identifying the compiler binary & version of build. */
+uint64_t compiler_identity(char *cc);
+
+/* Load the object state from `path`. Returns 1 if the file does not exist
+   or was written by a different version. */
+int objstate_load(struct objstate *state, char *path);
+int objstate_save(struct objstate *state, char *path);
+
+/* Add an input file, with its current mtime. */
+void objstate_add_input(struct objstate *state, char *path);
+
+/* Add all prerequisites from the make-style depfile generated by the
+   compiler with -MMD as inputs. The ones modified at or after `since`, as
+   returned by file_clock() before compiling, are recorded as changed.
+   Returns 1 if the depfile cannot be read, or -1 if any input changed. */
+int objstate_read_depfile(struct objstate *state, char *path, int64_t since);
+
+/* Record the contents & mtime of the file built from the state. If its hash
+   is `oldhash`, the mtime is set back to `oldmtime`, so the files built from
+   it don't look outdated. Returns true in that case. A file hardlinked
+   elsewhere, like into the cache, is copied first, so the other link keeps
+   its mtime. */
+bool objstate_set_output(struct objstate *state, char *path,
+		uint64_t oldhash, int64_t oldmtime);
+
+/* When enabled, file_mtime() caches the results until it is disabled
+   again. Not thread-safe. */
+void mtime_cache_enable(bool enabled);
+
+/* Returns the compiler family of the configured cc, which decides which
+   flags we can pass to it. */
+enum cc_family compiler_family(struct config *config);
+
+/* Returns true if the object has to be rebuilt, because the command, the
+   compiler or any of the inputs have changed. */
+bool objstate_dirty(struct objstate *state, uint64_t cmdhash,
+		uint64_t cchash);
+void objstate_free(struct objstate *state);
+
+/* Start recording a trace of the build, which is written to `path` in the
+   Chrome trace event format by trace_close(). */
+void trace_open(char *path);
+bool trace_enabled(void);
+
+/* Record a span from `start` to `end`, as returned by clock_now(). `tid` is
+   0 for the main thread, or the job slot + 1. Does nothing when tracing is
+   not enabled. */
+void trace_span(const char *name, const char *cat, int tid, double start,
+		double end);
+
+/* Write the trace and print a summary of the critical path, the average
+   parallelism and the idle time of the job slots. */
+void trace_close(void);
+
+/* Start collecting the times of the phases and the counters, which are
+   printed by stats_close() as a table, or as JSON if `json` is set. */
+void stats_open(bool json);
+bool stats_enabled(void);
+
+/* Add a span to the time of its phase, called by trace_span(). The setup
+   spans are a phase each, the others are grouped by their category. */
+void stats_span(const char *name, const char *cat, double start, double end);
+void stats_count(enum stat_counter counter, size_t n);
+void stats_close(void);
 
 void usage();
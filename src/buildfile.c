@@ -9,25 +9,29 @@
 
 static void set_config_defaults(struct config *config, size_t nfields,
 		const struct config_field *fields);
+static bool set_artifact_field(struct artifact *artifact, char *key,
+		char *val);
+static bool set_variant_field(struct variant *variant, char *key, char *val);
 
 
 int parse_buildfile(struct config *config)
 {
+	struct config_field config_fields[CONFIG_MAXFIELDS];
 	char *buf, *val, *collected_cmd, *target;
 	bool next_maybe_command = false;
+	struct artifact *artifact = NULL;
+	struct variant *variant = NULL;
+	struct strmap dirs = {0};
+	size_t len, buflen, nconfig_fields;
 	FILE *buildfile;
-	size_t len, buflen;
+	double started;
 
 	/* Set up config fields. */
-	const size_t nconfig_fields = 6;
-	const struct config_field config_fields[] = {
-		{"cc", FIELD_STR, &config->cc, BUILD_CC},
-		{"src", FIELD_STRLIST, &config->sources, NULL},
-		{"flags", FIELD_STRLIST, &config->flags, NULL},
-		{"libs", FIELD_STRLIST, &config->libraries, NULL},
-		{"out", FIELD_STR, &config->out, BUILD_OUT},
-		{"builddir", FIELD_STR, &config->builddir, BUILD_DIR},
-	};
+	nconfig_fields = buildfile_fields(config, config_fields);
+
+	/* Nothing changed since the last time, so take the parsed config. */
+	if (!snapshot_load(config))
+		goto end;
 
 	buildfile = fopen(config->buildfile, "r");
 	if (!buildfile)
@@ -75,6 +79,17 @@ int parse_buildfile(struct config *config)
 
 		/* RSD 10/1e: Parse multi-line targets. */
 		if (*buf == '@') {
+			/* "@name: a b" lists the targets to run before it, instead of
+			   the first command. */
+			if (len > 1 && buf[len-1] == ':') {
+				buf[len-1] = 0;
+				strncpy(target, buf + 1, SMALLBUFSIZ - 1);
+				strsplit(&config_add_target(config, target)->needs, val);
+				next_maybe_command = true;
+				free(val);
+				continue;
+			}
+
 			strncpy(target, buf + 1, SMALLBUFSIZ);
 			config_add_target(config, target);
 
@@ -86,6 +101,33 @@ int parse_buildfile(struct config *config)
 			continue;
 		}
 
+		/* The options after an artifact line belong to that artifact, if
+		   it has them. */
+		if (!strcmp(buf, "artifact")) {
+			artifact = *val ? config_add_artifact(config, val) : NULL;
+			variant = NULL;
+			free(val);
+			continue;
+		}
+
+		if (artifact && set_artifact_field(artifact, buf, val)) {
+			free(val);
+			continue;
+		}
+
+		/* The same for a variant. */
+		if (!strcmp(buf, "variant")) {
+			variant = *val ? config_add_variant(config, val) : NULL;
+			artifact = NULL;
+			free(val);
+			continue;
+		}
+
+		if (variant && set_variant_field(variant, buf, val)) {
+			free(val);
+			continue;
+		}
+
 		/* Use the config_fields table to assign values. */
 
 		for (size_t i = 0; i < nconfig_fields; i++) {
@@ -111,14 +153,35 @@ int parse_buildfile(struct config *config)
 		free(val);
 	}
 
+	/* The snapshot is only valid while the directories we searched for the
+	   sources don't change. */
+	walk_record(&dirs);
+
+	started = clock_now();
 	expand_wildcards(&config->sources);
+	for (size_t i = 0; i < config->nartifacts; i++)
+		expand_wildcards(&config->artifacts[i]->sources);
+	trace_span("expand_wildcards", "setup", 0, started, clock_now());
+
+	started = clock_now();
 	remove_excluded(&config->sources);
+	for (size_t i = 0; i < config->nartifacts; i++) {
+		remove_excluded(&config->artifacts[i]->sources);
+		if (!config->artifacts[i]->out)
+			config->artifacts[i]->out = strdup(config->artifacts[i]->name);
+	}
+	trace_span("remove_excluded", "setup", 0, started, clock_now());
 	set_config_defaults(config, nconfig_fields, config_fields);
+	walk_record(NULL);
 
 	free(target);
 	free(buf);
 	fclose(buildfile);
 
+	snapshot_save(config, &dirs);
+	strmap_free(&dirs);
+
+end:
 	if (config->explain) {
 		puts("Parsing the buildfile returned:");
 		config_dump(config);
@@ -127,19 +190,116 @@ int parse_buildfile(struct config *config)
 	return 0;
 }
 
+size_t buildfile_fields(struct config *config, struct config_field *fields)
+{
+	const struct config_field config_fields[] = {
+		{"cc", FIELD_STR, &config->cc, BUILD_CC},
+		{"src", FIELD_STRLIST, &config->sources, NULL},
+		{"flags", FIELD_STRLIST, &config->flags, NULL},
+		{"libs", FIELD_STRLIST, &config->libraries, NULL},
+		{"out", FIELD_STR, &config->out, BUILD_OUT},
+		{"kind", FIELD_STR, &config->kind, NULL},
+		{"ar", FIELD_STR, &config->ar, BUILD_AR},
+		{"lto", FIELD_STR, &config->lto, NULL},
+		{"builddir", FIELD_STR, &config->builddir, BUILD_DIR},
+		{"cache", FIELD_STR, &config->cache, NULL},
+		{"cachesize", FIELD_STR, &config->cachesize_str, BUILD_CACHESIZE},
+		{"maxload", FIELD_STR, &config->maxload_str, NULL},
+		{"maxmem", FIELD_STR, &config->maxmem_str, NULL},
+		{"maxpressure", FIELD_STR, &config->maxpressure_str, NULL},
+		{"pch", FIELD_STR, &config->pch, NULL},
+		{"unity", FIELD_STR, &config->unity, NULL},
+		{"unityexclude", FIELD_STRLIST, &config->unityexclude, NULL},
+		{"workers", FIELD_STRLIST, &config->workers, NULL},
+	};
+	size_t n = sizeof(config_fields) / sizeof(*config_fields);
+
+	memcpy(fields, config_fields, sizeof(config_fields));
+	return n;
+}
+
 static void set_config_defaults(struct config *config, size_t nfields,
 		const struct config_field *fields)
 {
+	size_t n;
+
 	for (size_t i = 0; i < nfields; i++) {
-		if (fields[i].type != FIELD_STR || * (char **) fields[i].val)
+		if (fields[i].type != FIELD_STR || * (char **) fields[i].val
+				|| !fields[i].default_val)
 			continue;
 		* (char **) fields[i].val = strdup(fields[i].default_val);
 	}
 
-	if (!config->user_sources)
-		find(&config->sources, 'f', ".", "*.c");
+	/* Generated sources in the build directories, like unity batches, are
+	   not part of the project. */
+	if (!config->user_sources && !config->nartifacts) {
+		find(&config->sources, ".", "*.c");
+		n = 0;
+		for (size_t i = 0; i < config->sources.size; i++) {
+			if (!config_in_builddir(config, config->sources.strs[i]))
+				config->sources.strs[n++] = config->sources.strs[i];
+			else
+				free(config->sources.strs[i]);
+		}
+		config->sources.size = n;
+	}
 
 	/* Use -pipe when possible to limit hard drive usage. */
 	if (!strcmp(config->cc, "clang") || !strcmp(config->cc, "gcc"))
 		strlist_append(&config->flags, "-pipe");
 }
+
+static bool set_artifact_field(struct artifact *artifact, char *key,
+		char *val)
+{
+	const struct config_field fields[] = {
+		{"src", FIELD_STRLIST, &artifact->sources, NULL},
+		{"flags", FIELD_STRLIST, &artifact->flags, NULL},
+		{"libs", FIELD_STRLIST, &artifact->libraries, NULL},
+		{"needs", FIELD_STRLIST, &artifact->needs, NULL},
+		{"out", FIELD_STR, &artifact->out, NULL},
+		{"kind", FIELD_STR, &artifact->kind, NULL},
+	};
+
+	for (size_t i = 0; i < sizeof(fields) / sizeof(*fields); i++) {
+		if (strcmp(key, fields[i].name) != 0)
+			continue;
+
+		if (fields[i].type == FIELD_STR) {
+			free(* (char **) fields[i].val);
+			* (char **) fields[i].val = strdup(val);
+		} else {
+			strsplit(fields[i].val, val);
+		}
+
+		return true;
+	}
+
+	return false;
+}
+
+static bool set_variant_field(struct variant *variant, char *key, char *val)
+{
+	const struct config_field fields[] = {
+		{"cc", FIELD_STR, &variant->cc, NULL},
+		{"flags", FIELD_STRLIST, &variant->flags, NULL},
+		{"out", FIELD_STR, &variant->out, NULL},
+		{"builddir", FIELD_STR, &variant->builddir, NULL},
+	};
+
+	for (size_t i = 0; i < sizeof(fields) / sizeof(*fields); i++) {
+		if (strcmp(key, fields[i].name) != 0)
+			continue;
+
+		if (fields[i].type == FIELD_STR) {
+			free(* (char **) fields[i].val);
+			* (char **) fields[i].val = strdup(val);
+		} else {
+			strsplit(fields[i].val, val);
+		}
+
+		return true;
+	}
+
+	return false;
+}
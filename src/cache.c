@@ -0,0 +1,467 @@
+/*
+ * cache.c - content-addressed object cache
+ * Copyright (c) 2022 mini-rose
+ */
+
+#include "build.h"
+#include <fcntl.h>
+
+
+/* The cache is a directory of files named after their hash, split into 256
+   subdirectories by the first byte:
+
+     xx/<key>.m     manifest: the headers & their content hashes
+     xx/<result>.o  the object file
+     xx/<result>.w  warnings printed by the compiler
+     stats          hit & miss counters, and the total size
+
+   The key hashes the compiler, the command and the source. Because the
+   headers are only known after compiling, they are listed in the manifest,
+   and the result is found by hashing the key with the current contents of
+   each listed header. A manifest keeps the last MANIFEST_ENTRIES header
+   sets, so switching between branches keeps hitting. Compilers without
+   depfiles use the preprocessed source instead, leaving the manifest
+   empty. */
+
+#define MANIFEST_ENTRIES    16
+
+struct cache_file
+{
+	char *path;
+	int64_t mtime;
+	off_t size;
+};
+
+static struct
+{
+	struct strmap hashes;           /* content hash of each header */
+	int hits;
+	int misses;
+	long long added;                /* bytes */
+	struct cache_file *files;       /* used for eviction */
+	size_t nfiles;
+	unsigned ntmp;                  /* temporary files named so far */
+} cache;
+
+static char *entry_path(struct config *config, uint64_t hash, char *ext);
+static int content_hash(char *path, uint64_t *hash);
+static bool result_key(uint64_t key, struct strlist *headers,
+		uint64_t *result);
+static size_t read_manifest(char *path, struct strlist *entries);
+static void evict(struct config *config, long long *size);
+
+
+void cache_init(struct config *config)
+{
+	char *home, *expanded;
+
+	if (!config->cache)
+		return;
+
+	/* Allow the usual ~/.cache/build path. */
+	if (config->cache[0] == '~' && config->cache[1] == '/'
+			&& (home = getenv("HOME"))) {
+		expanded = malloc(strlen(home) + strlen(config->cache));
+		sprintf(expanded, "%s%s", home, config->cache + 1);
+		free(config->cache);
+		config->cache = expanded;
+	}
+
+	config->cachesize = parse_size(config->cachesize_str);
+	if (mkdir_p(config->cache)) {
+		fprintf(stderr, "build: cannot create cache %s\n", config->cache);
+		free(config->cache);
+		config->cache = NULL;
+	}
+}
+
+uint64_t cache_key(struct config *config, char *source, char *cmd,
+		char *preprocessed)
+{
+	uint64_t hash = HASH_INIT;
+
+	hash = hash_bytes(hash, &config->cchash, sizeof(config->cchash));
+	hash = hash_str(hash, cmd);
+
+	if (hash_file(&hash, config->ccfamily != CC_OTHER ? source
+				: preprocessed))
+		return 0;
+
+	/* 0 means no key. */
+	return hash ? hash : 1;
+}
+
+pid_t cache_preprocess(struct config *config, char *source, char *output)
+{
+	struct strlist argv = {0};
+	char *sh[] = {"sh", "-c", NULL, NULL};
+	pid_t pid;
+
+	/* The output is redirected by us, not every compiler takes -o with -E.
+	   Errors are reported by compiling. The shell only gets the command,
+	   if the buildfile relies on it. */
+	strsplit(&argv, config->cc);
+	strlist_append(&argv, "-E");
+	strlist_append(&argv, source);
+	for (size_t i = 0; i < config->flags.size; i++)
+		strlist_append(&argv, config->flags.strs[i]);
+
+	if (needs_shell(config)) {
+		sh[2] = strlist_join(&argv, " ");
+		pid = spawn_redirect(sh, output, "/dev/null");
+		free(sh[2]);
+	} else {
+		pid = spawn_redirect(strlist_terminate(&argv), output, "/dev/null");
+	}
+
+	strlist_free(&argv);
+	return pid;
+}
+
+bool cache_contains(struct config *config, uint64_t key)
+{
+	struct strlist entries[MANIFEST_ENTRIES] = {0};
+	char *manifest, *result;
+	size_t nentries;
+	uint64_t rkey;
+	bool found = false;
+
+	manifest = entry_path(config, key, ".m");
+	nentries = read_manifest(manifest, entries);
+
+	for (size_t i = 0; i < nentries && !found; i++) {
+		if (!result_key(key, &entries[i], &rkey))
+			continue;
+		result = entry_path(config, rkey, ".o");
+		found = !access(result, F_OK);
+		free(result);
+	}
+
+	for (size_t i = 0; i < nentries; i++)
+		strlist_free(&entries[i]);
+	free(manifest);
+	return found;
+}
+
+bool cache_fetch(struct config *config, uint64_t key, char *source,
+		char *object, struct objstate *state)
+{
+	struct strlist entries[MANIFEST_ENTRIES] = {0};
+	char *manifest, *result = NULL, *warnings;
+	size_t nentries, i;
+	uint64_t rkey;
+	bool hit = false;
+
+	manifest = entry_path(config, key, ".m");
+	nentries = read_manifest(manifest, entries);
+
+	/* Try each header set the source was compiled with, newest first. */
+	for (i = 0; i < nentries; i++) {
+		if (!result_key(key, &entries[i], &rkey))
+			continue;
+
+		result = entry_path(config, rkey, ".o");
+		unlink(object);
+		if (!clone_file(result, object))
+			break;
+
+		free(result);
+		result = NULL;
+	}
+
+	if (i == nentries)
+		goto end;
+
+	/* Touching the object also touches the hardlinked cache entry, which
+	   keeps it from being evicted and makes it newer than the output. */
+	utimensat(AT_FDCWD, object, NULL, 0);
+	utimensat(AT_FDCWD, manifest, NULL, 0);
+
+	warnings = entry_path(config, rkey, ".w");
+	cat_file(warnings, stderr);
+	free(warnings);
+
+	objstate_add_input(state, source);
+	for (size_t j = 0; j < entries[i].size; j++)
+		objstate_add_input(state, entries[i].strs[j] + 17);
+	hit = true;
+
+end:
+	if (hit)
+		cache.hits++;
+	else
+		cache.misses++;
+
+	for (i = 0; i < nentries; i++)
+		strlist_free(&entries[i]);
+	free(result);
+	free(manifest);
+	return hit;
+}
+
+void cache_store(struct config *config, uint64_t key, char *object,
+		char *log, struct objstate *state)
+{
+	struct strlist entries[MANIFEST_ENTRIES] = {0};
+	struct strlist headers = {0};
+	char line[LINESIZE], *path, *tmp;
+	size_t nentries = 0;
+	uint64_t hash, rkey;
+	long long added = 0;
+	struct stat st;
+	FILE *f;
+
+	/* The first input is the source, which is already part of the key. */
+	for (size_t i = 1; i < state->inputs.size; i++) {
+		if (content_hash(state->inputs.strs[i], &hash))
+			goto end;
+		snprintf(line, LINESIZE, "%016llx %s", (unsigned long long) hash,
+				state->inputs.strs[i]);
+		strlist_append(&headers, line);
+	}
+
+	if (!result_key(key, &headers, &rkey))
+		goto end;
+
+	/* Everything is first written to a temporary file and then renamed, so
+	   another build never sees a half-written entry. */
+	tmp = malloc(strlen(config->cache) + 32);
+	sprintf(tmp, "%s/tmp.%d.%u", config->cache, (int) getpid(),
+			cache.ntmp++);
+
+	path = entry_path(config, rkey, ".o");
+	if (!clone_file(object, tmp) && !rename(tmp, path) && !stat(path, &st))
+		added += st.st_size;
+	free(path);
+
+	if (!stat(log, &st) && st.st_size) {
+		path = entry_path(config, rkey, ".w");
+		if (!clone_file(log, tmp) && !rename(tmp, path))
+			added += st.st_size;
+		free(path);
+	}
+
+	/* Put the new header set in front of the old ones, dropping the oldest
+	   one if the manifest is full. */
+	path = entry_path(config, key, ".m");
+	nentries = read_manifest(path, entries);
+	f = fopen(tmp, "w");
+	if (f) {
+		fputs("r\n", f);
+		for (size_t i = 0; i < headers.size; i++)
+			fprintf(f, "h %s\n", headers.strs[i]);
+
+		for (size_t i = 0; i < nentries && i < MANIFEST_ENTRIES - 1; i++) {
+			fputs("r\n", f);
+			for (size_t j = 0; j < entries[i].size; j++)
+				fprintf(f, "h %s\n", entries[i].strs[j]);
+		}
+
+		fclose(f);
+		if (!rename(tmp, path) && !stat(path, &st))
+			added += st.st_size;
+	}
+
+	for (size_t i = 0; i < nentries; i++)
+		strlist_free(&entries[i]);
+
+	unlink(tmp);
+	free(path);
+	free(tmp);
+
+	cache.added += added;
+
+end:
+	strlist_free(&headers);
+}
+
+void cache_finish(struct config *config)
+{
+	long long hits = 0, misses = 0, size = 0;
+	char *path;
+	FILE *f;
+	int fd;
+
+	if (!config->cache)
+		return;
+
+	path = malloc(strlen(config->cache) + 8);
+	sprintf(path, "%s/stats", config->cache);
+
+	/* Other builds may be using the same cache, so update the totals under
+	   a lock. */
+	fd = open(path, O_RDWR | O_CREAT, 0664);
+	if (fd == -1)
+		goto end;
+	lockf(fd, F_LOCK, 0);
+
+	f = fdopen(fd, "r+");
+	if (fscanf(f, "hits %lld misses %lld size %lld", &hits, &misses,
+				&size) != 3)
+		hits = misses = size = 0;
+
+	hits += cache.hits;
+	misses += cache.misses;
+	size += cache.added;
+
+	if (size > config->cachesize)
+		evict(config, &size);
+
+	rewind(f);
+	fprintf(f, "hits %lld misses %lld size %lld\n", hits, misses, size);
+	fflush(f);
+	ftruncate(fd, ftell(f));
+	lockf(fd, F_ULOCK, 0);
+	fclose(f);
+
+	if (config->explain) {
+		printf("cache: %d hits, %d misses (total: %lld hits, %lld misses, "
+				"%lld of %lld bytes used)\n", cache.hits, cache.misses,
+				hits, misses, size, config->cachesize);
+	}
+
+end:
+	strmap_free(&cache.hashes);
+	cache.hits = cache.misses = 0;
+	cache.added = 0;
+	free(path);
+}
+
+static char *entry_path(struct config *config, uint64_t hash, char *ext)
+{
+	size_t len;
+	char *path;
+
+	len = strlen(config->cache) + strlen(ext) + 24;
+	path = malloc(len);
+
+	/* Create the subdirectory on the go, it may fail if it exists. */
+	snprintf(path, len, "%s/%02x", config->cache, (unsigned) (hash >> 56));
+	mkdir(path, 0775);
+
+	snprintf(path, len, "%s/%02x/%014llx%s", config->cache,
+			(unsigned) (hash >> 56),
+			(unsigned long long) hash & 0xffffffffffffffULL, ext);
+	return path;
+}
+
+static int content_hash(char *path, uint64_t *hash)
+{
+	uint64_t h;
+	bool found;
+
+	found = strmap_get(&cache.hashes, path, &h);
+	if (!found) {
+		h = HASH_INIT;
+		if (hash_file(&h, path))
+			return 1;
+
+		strmap_set(&cache.hashes, path, h);
+	}
+
+	*hash = h;
+	return 0;
+}
+
+static bool result_key(uint64_t key, struct strlist *headers,
+		uint64_t *result)
+{
+	uint64_t hash, expected;
+
+	/* Each header line is "<hash> <path>", compare the recorded hash with
+	   the current contents. */
+	*result = hash_bytes(HASH_INIT, &key, sizeof(key));
+	for (size_t i = 0; i < headers->size; i++) {
+		if (strlen(headers->strs[i]) < 18)
+			return false;
+		expected = strtoull(headers->strs[i], NULL, 16);
+		if (content_hash(headers->strs[i] + 17, &hash) || hash != expected)
+			return false;
+		*result = hash_str(*result, headers->strs[i]);
+	}
+
+	return true;
+}
+
+static size_t read_manifest(char *path, struct strlist *entries)
+{
+	char buf[LINESIZE];
+	size_t n = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+
+	while (fgets(buf, LINESIZE, f)) {
+		buf[linelen(buf)] = 0;
+		if (buf[0] == 'r' && n < MANIFEST_ENTRIES) {
+			n++;
+		} else if (buf[0] == 'h' && buf[1] == ' ' && n
+				&& n <= MANIFEST_ENTRIES) {
+			strlist_append(&entries[n - 1], buf + 2);
+		}
+	}
+
+	fclose(f);
+	return n;
+}
+
+static int collect_callback(const char *path, const struct stat *st,
+		int type, struct FTW *ftwbuf)
+{
+	(void) ftwbuf;
+
+	if (type != FTW_F || strstr(path, "/stats"))
+		return 0;
+
+	cache.files = realloc(cache.files, sizeof(*cache.files)
+			* (cache.nfiles + 1));
+	cache.files[cache.nfiles++] = (struct cache_file) {
+		.path = strdup(path),
+		.mtime = (int64_t) st->st_mtim.tv_sec * 1000000000
+			+ st->st_mtim.tv_nsec,
+		.size = st->st_size
+	};
+
+	return 0;
+}
+
+static int cmp_cache_file(const void *a, const void *b)
+{
+	const struct cache_file *fa = a, *fb = b;
+	return (fa->mtime > fb->mtime) - (fa->mtime < fb->mtime);
+}
+
+static void evict(struct config *config, long long *size)
+{
+	long long total = 0, limit;
+	size_t i;
+
+	/* Recount the real size, then remove the least recently used files
+	   until we get below 90% of the limit, so we don't have to evict
+	   again on the next build. */
+
+	nftw(config->cache, collect_callback, 64, FTW_PHYS);
+	qsort(cache.files, cache.nfiles, sizeof(*cache.files), cmp_cache_file);
+
+	for (i = 0; i < cache.nfiles; i++)
+		total += cache.files[i].size;
+
+	limit = config->cachesize / 10 * 9;
+	for (i = 0; i < cache.nfiles && total > limit; i++) {
+		if (!unlink(cache.files[i].path))
+			total -= cache.files[i].size;
+	}
+
+	if (config->explain)
+		printf("cache: evicted %zu files\n", i);
+
+	for (i = 0; i < cache.nfiles; i++)
+		free(cache.files[i].path);
+	free(cache.files);
+	cache.files = NULL;
+	cache.nfiles = 0;
+
+	*size = total;
+}
@@ -0,0 +1,99 @@
+/*
+ * cc.c - compiler detection
+ * Copyright (c) 2022 mini-rose
+ */
+
+#include "build.h"
+
+
+static enum cc_family family_from_name(char *cc);
+static enum cc_family family_from_probe(char *cc);
+
+
+enum cc_family compiler_family(struct config *config)
+{
+	enum cc_family family;
+	unsigned long long hash;
+	char *path;
+	FILE *f;
+	int fam;
+
+	family = family_from_name(config->cc);
+	if (family != CC_OTHER)
+		return family;
+
+	/* Names like cc or c99 don't tell us anything, so ask the compiler
+	   itself. The answer is cached in the build directory for as long as
+	   the compiler binary stays the same. */
+
+	path = malloc(strlen(config->builddir) + 10);
+	sprintf(path, "%s/cc.state", config->builddir);
+
+	f = fopen(path, "r");
+	if (f) {
+		if (fscanf(f, "%llx %d", &hash, &fam) == 2 && hash == config->cchash)
+			family = (enum cc_family) fam;
+		else
+			family = CC_UNKNOWN;
+		fclose(f);
+	} else {
+		family = CC_UNKNOWN;
+	}
+
+	if (family == CC_UNKNOWN) {
+		family = family_from_probe(config->cc);
+		f = fopen(path, "w");
+		if (f) {
+			fprintf(f, "%016llx %d\n", (unsigned long long) config->cchash,
+					family);
+			fclose(f);
+		}
+	}
+
+	free(path);
+	return family;
+}
+
+static enum cc_family family_from_name(char *cc)
+{
+	char *name;
+
+	/* Take the last word, so "ccache gcc" is still gcc. */
+	name = strrchr(cc, ' ');
+	name = name ? name + 1 : cc;
+	if (strrchr(name, '/'))
+		name = strrchr(name, '/') + 1;
+
+	if (strstr(name, "clang"))
+		return CC_CLANG;
+	if (strstr(name, "gcc") || strstr(name, "g++"))
+		return CC_GCC;
+	return CC_OTHER;
+}
+
+static enum cc_family family_from_probe(char *cc)
+{
+	enum cc_family family = CC_OTHER;
+	char cmd[LINESIZE];
+	FILE *res;
+
+	snprintf(cmd, LINESIZE, "%s --version 2>/dev/null", cc);
+	res = popen(cmd, "r");
+	if (!res)
+		return CC_OTHER;
+	stats_count(STAT_SPAWNED, 1);
+	stats_count(STAT_CMDBYTES, strlen(cmd) + 1);
+
+	while (fgets(cmd, LINESIZE, res)) {
+		if (family != CC_OTHER)
+			continue;
+		if (strstr(cmd, "clang"))
+			family = CC_CLANG;
+		else if (strstr(cmd, "gcc") || strstr(cmd, "GCC")
+				|| strstr(cmd, "Free Software Foundation"))
+			family = CC_GCC;
+	}
+
+	pclose(res);
+	return family;
+}
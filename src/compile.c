@@ -6,197 +6,1377 @@
 #include "build.h"
 
 
-/* Split config.soures.size tasks among `n` threads. The thread_tasks will be
-   filled with index ranges into the source array, so that it can be passed
-   as an argument to the thread. */
-void split_tasks(struct config *config, struct thread_task *tasks, int n);
+/* Archives are not built in one go after compiling. Once ARCHIVE_MIN objects
+   of a big archive are compiled, they are added to it while the rest is
+   still compiling, in up to ARCHIVE_BATCHES runs of ar, and the last one
+   only adds the rest & writes the symbol table. */
+#define ARCHIVE_BATCHES     4
+#define ARCHIVE_MIN         16
 
-/* Run the given task. Launched as a pthread. */
-void *run_thread_task(struct thread_task *task);
-typedef void * (*thread_ft) (void *);
+/* A single source to compile. */
+struct unit
+{
+	size_t output;                  /* index into ctx->outputs */
+	size_t source;                  /* index into config->sources */
+	struct strlist argv;
+	size_t rspfirst;                /* first argument after the compiler */
+	char *cmd;                      /* argv joined with spaces */
+	char *object;
+	char *statepath;
+	char *depfile;
+	char *log;
+	uint64_t key;                   /* cache key, 0 if not cached */
+	bool keyed;                     /* the key is computed */
+	bool preprocess;                /* waits for its key from cc -E */
+	char *preprocessed;             /* output of cc -E, while running */
+	struct objstate state;
+	bool edited;                    /* the source changed itself */
+	double cost;                    /* predicted compile time */
+	long rss;                       /* predicted peak memory */
+	uint64_t objhash;               /* contents of the old object */
+	int64_t objmtime;
+	int64_t since;                  /* file_clock() before compiling */
+	pid_t pid;                      /* compiler, while running */
+	bool remote;                    /* compiled by a worker */
+};
+
+/* An output file: the main one, or one of the artifacts. It is linked as
+   soon as its own sources compiled and the outputs it needs are linked. */
+struct output
+{
+	struct config *config;          /* with the sources & flags of it */
+	size_t pending;                 /* units left to compile */
+	size_t *needs;                  /* indices of the needed outputs */
+	size_t nneeds;
+	struct strlist argv;            /* link command */
+	size_t objfirst, objlast;       /* the objects in argv */
+	char *statepath;
+	enum output_kind kind;
+	struct strlist archive;         /* objects to add to the archive */
+	size_t batchsize;               /* objects to add in a batch */
+	bool fresh;                     /* create the archive from scratch */
+	bool archiving;                 /* ar is running */
+	bool touched;                   /* the archive was changed */
+	int ltotokens;                  /* taken for the LTO jobs of the link */
+	bool failed;
+	bool done;
+};
+
+/* The jobs are the links first, so a link which is ready runs before the
+   remaining compiles, then the archive batches, and then the units. With a
+   cache and a compiler without depfiles, each unit is preceded by running
+   the preprocessor for its key, in a job after all units. */
+struct compile_ctx
+{
+	struct config *config;
+	struct config *variants;        /* configs of the variants to build */
+	size_t nvariants;
+	struct output *outputs;
+	size_t noutputs;
+	size_t *batches;                /* output of each archive batch */
+	size_t nbatches;
+	size_t unitbase;                /* job of the first unit */
+	size_t ppbase;                  /* job preprocessing the first unit */
+	struct worker *workers;
+	size_t nworkers;
+	int nlocal;                     /* slots before the remote ones */
+	size_t *slotworkers;            /* worker of each remote slot */
+	struct unit *units;
+	size_t nunits;
+	size_t nstarted;                /* units started, for the progress */
+	int failed_units;
+	bool linked;
+};
+
+/* Set up an output for each artifact, and for the main output if it has
+   sources, in each variant to build. Returns 1 if an artifact needs an
+   unknown one, or needs itself. */
+static int prepare_outputs(struct compile_ctx *ctx);
+
+/* Set up a config for each variant to build, with its outputs. Returns 1
+   if -V names an unknown one. */
+static int prepare_variants(struct compile_ctx *ctx);
+
+/* Add the outputs of the config: its main output & the artifacts. */
+static int add_outputs(struct compile_ctx *ctx, struct config *config);
+static bool needs_cycle(struct compile_ctx *ctx, size_t output, char *marks);
+
+/* Add the units for all out of date sources of the output. */
+static void check_output(struct compile_ctx *ctx, size_t output);
+
+/* Find out if the archive has to be created again, and which objects that
+   are not compiled again have to be added to it anyway. */
+static void check_archive(struct output *output, bool *compiling);
+
+/* Add the archive batches of the outputs with enough units to compile. */
+static void plan_archives(struct compile_ctx *ctx);
+
+static bool is_archive(struct output *output);
+
+static pid_t start_job(struct jobqueue *queue, size_t job, int slot);
+static void finish_job(struct jobqueue *queue, size_t job,
+		struct proc_result *res);
+static int ready_job(struct jobqueue *queue, size_t job);
+
+/* Start compiling a unit. Returns the pid of the compiler, or 0 if the
+   object was taken from the cache. */
+static pid_t start_unit(struct compile_ctx *ctx, struct unit *unit, int slot);
+
+/* Start preprocessing the unit for its cache key. Returns 0 if the key
+   cannot be computed. */
+static pid_t start_preprocess(struct compile_ctx *ctx, struct unit *unit);
+static void finish_preprocess(struct compile_ctx *ctx, struct unit *unit,
+		struct proc_result *res);
+
+/* Returns the cache key of the unit, computed on the first call. */
+static uint64_t unit_key(struct compile_ctx *ctx, struct unit *unit);
+
+/* Ask the workers for their slots, and hand the remote slots to them.
+   Returns the amount of remote slots. */
+static int plan_workers(struct compile_ctx *ctx);
+
+/* Start compiling the unit on a worker. Returns 0 if it cannot be compiled
+   remotely. */
+static pid_t start_remote(struct compile_ctx *ctx, struct unit *unit,
+		struct worker *worker);
+
+/* Finish the unit after the compiler exited with `status`. */
+static void finish_unit(struct compile_ctx *ctx, struct unit *unit,
+		struct proc_result *res);
+
+/* Returns true if the limits allow starting the job next to the running
+   ones. */
+static bool admit_job(struct jobqueue *queue, size_t job, size_t *running,
+		int nrunning);
 
-/* Link all generated object files. */
-void link_object_files(struct config *config);
+/* Start linking the output, unless it is up to date. Returns the pid of
+   the linker, or 0. */
+static pid_t start_link(struct compile_ctx *ctx, struct output *output);
+static void finish_link(struct compile_ctx *ctx, struct output *output,
+		struct proc_result *res);
 
+/* Add the compiled objects to the archive, and its symbol table if `final`
+   is set. Returns the pid of ar, or 0 if there is nothing to do. */
+static pid_t start_archive(struct compile_ctx *ctx, struct output *output,
+		bool final);
+static void finish_archive(struct output *output, struct proc_result *res);
 
-void compile(struct config *config)
+/* Put the arguments linking the output into `argv`. The needed outputs
+   which are libraries go after the objects. Sets the range of the objects
+   in `argv`, which go into a response file if the command is too long. */
+static void link_command(struct compile_ctx *ctx, struct output *output,
+		struct strlist *argv);
+
+/* Put the ar command for the output into `argv`, without the objects. The
+   symbol table is only written with `index`. */
+static void archive_command(struct config *config, bool index,
+		struct strlist *argv);
+
+/* Returns true if the link command, any object or the output changed since
+   the last link. */
+static bool link_outdated(struct config *config, char *statepath,
+		uint64_t cmdhash);
+
+/* Start the command, with a response file named after `path` if it is too
+   long. */
+static pid_t spawn_rsp(struct config *config, struct strlist *argv,
+		size_t first, size_t last, char *path, char *errlog);
+
+/* Put the arguments compiling the source at `index` into `argv`. Returns
+   the index of the first argument after the compiler. */
+static size_t compile_command(struct config *config, size_t index,
+		struct strlist *argv);
+
+/* Sort the units, so the edited ones come first and then the ones which
+   took the longest last time. Returns the predicted makespan. */
+static double schedule_units(struct unit *units, size_t n, int nslots);
+static int cmp_unit(const void *a, const void *b);
+
+
+int compile(struct config *config)
 {
-	struct thread_task *thread_tasks;
-	struct stat st = {0};
-	pthread_t *threads;
-	int nprocs, ret;
+	struct compile_ctx ctx = { .config = config };
+	struct jobqueue queue = {0};
+	struct output *output;
+	double predicted, started;
+	size_t nsources;
+	int nprocs, nremote, failed;
 
-	/* Create the build directory for the objects */
-	if (stat(config->builddir, &st) == -1)
-		mkdir(config->builddir, 0775);
+	/* Create the build directory for the objects. It is kept between runs,
+	   so only the sources that changed since the last build get compiled. */
+	mkdir_p(config->builddir);
 
-	/* Amount of threads to use. If the thread count is 1, just use the main
-	   thread to do all the work instead of creating a seperate one. */
+	/* Only ask the compiler once, when rebuilding in watch mode. */
+	if (!config->cchash) {
+		config->cchash = compiler_identity(config->cc);
+		config->ccfamily = compiler_family(config);
+	}
+	cache_init(config);
 
-	if (config->use_n_threads)
-		nprocs = config->use_n_threads;
-	else
-		nprocs = get_nprocs();
+	if (prepare_outputs(&ctx)) {
+		cache_finish(config);
+		return 1;
+	}
 
-	if (nprocs <= 0 || nprocs > MAX_PROCS) {
-		fprintf(stderr, "build: thread amount out of range (%d)\n", nprocs);
+	nsources = 0;
+	for (size_t i = 0; i < ctx.noutputs; i++)
+		nsources += ctx.outputs[i].config->sources.size;
+
+	/* Headers are shared by a lot of objects, so only stat them once. */
+	started = clock_now();
+	mtime_cache_enable(true);
+
+	ctx.units = calloc(nsources + 1, sizeof(*ctx.units));
+	for (size_t i = 0; i < ctx.noutputs; i++)
+		check_output(&ctx, i);
+
+	mtime_cache_enable(false);
+	trace_span("check", "setup", 0, started, clock_now());
+	plan_archives(&ctx);
+
+	/* Amount of compilers to run at once. With a jobserver, this is only
+	   the upper limit. */
+
+	nprocs = config->njobs;
+	if (nprocs <= 0) {
+		fprintf(stderr, "build: job amount out of range (%d)\n", nprocs);
 		exit(EXIT_THREAD);
 	}
 
-	if (nprocs == 1) {
-		threads = NULL;
-		thread_tasks = malloc(sizeof(*thread_tasks));
-		thread_tasks[0] = (struct thread_task) {
-			.config = config,
-			.from = 0,
-			.to = config->sources.size - 1,
-			.tid = 0
-		};
+	predicted = schedule_units(ctx.units, ctx.nunits, nprocs);
+
+	ctx.ppbase = ctx.unitbase + ctx.nunits;
+	for (size_t i = 0; i < ctx.nunits; i++) {
+		output = &ctx.outputs[ctx.units[i].output];
+		ctx.units[i].preprocess = output->config->cache
+			&& output->config->ccfamily == CC_OTHER;
+	}
+
+	/* Workers are only asked when there is something to compile. */
+	ctx.nlocal = nprocs;
+	nremote = ctx.nunits ? plan_workers(&ctx) : 0;
+
+	queue = (struct jobqueue) {
+		.njobs = ctx.ppbase + ctx.nunits,
+		.nslots = nprocs + nremote,
+		.nremote = nremote,
+		.data = &ctx,
+		.start = start_job,
+		.finish = finish_job,
+		.admit = admit_job,
+		.ready = ready_job
+	};
+
+	started = clock_now();
+	failed = jobs_run(&queue);
+	cache_finish(config);
+
+	if (config->explain && ctx.nunits) {
+		printf("makespan: predicted %.2fs, actual %.2fs\n", predicted,
+				clock_now() - started);
+	}
+
+	/* The outputs of the sources that failed were not linked, so they
+	   don't contain stale objects. */
+	if (ctx.failed_units) {
+		fprintf(stderr, "\nbuild: %d source(s) failed to compile\n",
+				ctx.failed_units);
+	} else if (!failed && ctx.linked) {
+		printf("\033[2K\r[%zu/%zu] Done\n", ctx.nunits, ctx.nunits);
+	}
+
+	for (size_t i = 0; i < ctx.nunits; i++) {
+		strlist_free(&ctx.units[i].argv);
+		free(ctx.units[i].cmd);
+		free(ctx.units[i].statepath);
+		free(ctx.units[i].preprocessed);
+	}
+
+	for (size_t i = 0; i < ctx.noutputs; i++) {
+		strlist_free(&ctx.outputs[i].argv);
+		strlist_free(&ctx.outputs[i].archive);
+		free(ctx.outputs[i].statepath);
+		free(ctx.outputs[i].needs);
+		config_artifact_free(ctx.outputs[i].config);
+		free(ctx.outputs[i].config);
+	}
+
+	for (size_t i = 0; i < ctx.nvariants; i++)
+		config_artifact_free(&ctx.variants[i]);
+
+	remote_free(ctx.workers, ctx.nworkers);
+	free(ctx.slotworkers);
+	free(ctx.outputs);
+	free(ctx.variants);
+	free(ctx.batches);
+	free(ctx.units);
+	return failed;
+}
+
+static int prepare_outputs(struct compile_ctx *ctx)
+{
+	struct config *config = ctx->config;
+	struct output *output;
+	char *marks, *dir;
+
+	if (!config->nvariants && !config->called_variants.size) {
+		if (add_outputs(ctx, config))
+			return 1;
+	} else if (prepare_variants(ctx)) {
+		return 1;
+	}
+
+	for (size_t i = 0; i < ctx->noutputs; i++) {
+		output = &ctx->outputs[i];
+
+		/* The outputs of a variant go into a directory named after it. */
+		dir = strrchr(output->config->out, '/');
+		if (output->config->variant && dir) {
+			dir = strndup(output->config->out, dir - output->config->out);
+			mkdir_p(dir);
+			free(dir);
+		}
+
+		output->kind = output_kind(output->config);
+		if (output->kind == OUTPUT_UNKNOWN) {
+			fprintf(stderr, "build: unknown kind %s of %s, expected "
+					"executable, static, thin or shared\n",
+					output->config->kind, output->config->out);
+			return 1;
+		}
+
+		if (lto_mode(output->config) == LTO_UNKNOWN) {
+			fprintf(stderr, "build: unknown lto %s, expected thin, full or "
+					"off\n", output->config->lto);
+			return 1;
+		}
+
+		/* The pch & unity batches are compiled with the flags too. */
+		if (output->kind == OUTPUT_SHARED)
+			strlist_append(&output->config->flags, "-fPIC");
+		lto_prepare(output->config);
+	}
+
+	marks = calloc(ctx->noutputs, 1);
+	for (size_t i = 0; i < ctx->noutputs; i++) {
+		if (needs_cycle(ctx, i, marks)) {
+			fprintf(stderr, "build: the artifacts needed by %s form a "
+					"cycle\n", ctx->outputs[i].config->name);
+			free(marks);
+			return 1;
+		}
+	}
+
+	free(marks);
+	return 0;
+}
+
+static int prepare_variants(struct compile_ctx *ctx)
+{
+	struct config *config = ctx->config, *vc;
+	struct variant *variant;
+	size_t n, index;
+	bool seen;
+
+	/* Without -V, all of them. */
+	n = config->called_variants.size ? config->called_variants.size
+		: config->nvariants;
+	ctx->variants = calloc(n, sizeof(*ctx->variants));
+
+	for (size_t i = 0; i < n; i++) {
+		index = i;
+		if (config->called_variants.size) {
+			index = config_find_variant(config,
+					config->called_variants.strs[i]);
+			if (index == INVALID_INDEX) {
+				fprintf(stderr, "build: unknown variant %s\n",
+						config->called_variants.strs[i]);
+				return 1;
+			}
+		}
+
+		variant = config->variants[index];
+		seen = false;
+		for (size_t j = 0; j < ctx->nvariants; j++)
+			seen |= ctx->variants[j].variant == variant->name;
+		if (seen)
+			continue;
+
+		vc = &ctx->variants[ctx->nvariants++];
+		config_variant(config, variant, vc);
+		mkdir_p(vc->builddir);
 
-		run_thread_task(&thread_tasks[0]);
-		goto link_stage;
+		/* A variant with its own compiler asks it once, like compile(). */
+		if (variant->cc && !variant->cchash) {
+			vc->cchash = variant->cchash = compiler_identity(vc->cc);
+			vc->ccfamily = variant->ccfamily = compiler_family(vc);
+		}
+
+		if (add_outputs(ctx, vc))
+			return 1;
 	}
 
-	thread_tasks = calloc(nprocs, sizeof(*thread_tasks));
-	split_tasks(config, thread_tasks, nprocs);
+	return 0;
+}
+
+static int add_outputs(struct compile_ctx *ctx, struct config *config)
+{
+	struct output *output;
+	struct artifact *artifact;
+	size_t need, base;
+
+	ctx->outputs = realloc(ctx->outputs, sizeof(*ctx->outputs)
+			* (ctx->noutputs + config->nartifacts + 1));
+	memset(ctx->outputs + ctx->noutputs, 0, sizeof(*ctx->outputs)
+			* (config->nartifacts + 1));
+
+	/* With artifacts, the main output only exists if it has sources. It is
+	   a copy too, as preparing the pch & unity batches changes the config,
+	   which must stay the same for the next build in watch mode. */
+	if (config->sources.size || !config->nartifacts) {
+		output = &ctx->outputs[ctx->noutputs++];
+		output->config = malloc(sizeof(struct config));
+		config_artifact(config, NULL, output->config);
+	}
+	base = ctx->noutputs;
 
-	threads = calloc(nprocs, sizeof(*threads));
-	for (int i = 0; i < nprocs; i++) {
-		/* Setup thread data */
-		thread_tasks[i].tid = i;
-		thread_tasks[i].config = config;
+	for (size_t i = 0; i < config->nartifacts; i++) {
+		artifact = config->artifacts[i];
+		output = &ctx->outputs[ctx->noutputs++];
+		output->config = malloc(sizeof(struct config));
+		config_artifact(config, artifact, output->config);
 
-		/* Stop creating threads if they have nothing to do. */
-		if (thread_tasks[i].from == -1)
-			break;
+		output->needs = calloc(artifact->needs.size + 1, sizeof(size_t));
+		for (size_t j = 0; j < artifact->needs.size; j++) {
+			need = config_find_artifact(config, artifact->needs.strs[j]);
+			if (need == INVALID_INDEX) {
+				fprintf(stderr, "build: artifact %s needs an unknown artifact "
+						"%s\n", artifact->name, artifact->needs.strs[j]);
+				return 1;
+			}
 
-		ret = pthread_create(&threads[i], NULL, (thread_ft) run_thread_task,
-				&thread_tasks[i]);
-		if (ret) {
-			fprintf(stderr, "failed to create a thread\n");
-			exit(EXIT_THREAD);
+			/* The artifacts come after the main output. */
+			output->needs[output->nneeds++] = need + base;
 		}
 	}
 
-	for (int i = 0; i < nprocs; i++) {
-		if (thread_tasks[i].from == -1)
-			break;
-		pthread_join(threads[i], NULL);
+	return 0;
+}
+
+static bool needs_cycle(struct compile_ctx *ctx, size_t output, char *marks)
+{
+	struct output *o = &ctx->outputs[output];
+
+	/* 1 while visiting, 2 when done. */
+	if (marks[output])
+		return marks[output] == 1;
+
+	marks[output] = 1;
+	for (size_t i = 0; i < o->nneeds; i++) {
+		if (needs_cycle(ctx, o->needs[i], marks))
+			return true;
 	}
 
-link_stage:
-	link_object_files(config);
+	marks[output] = 2;
+	return false;
+}
+
+static void check_output(struct compile_ctx *ctx, size_t index)
+{
+	struct output *output = &ctx->outputs[index];
+	struct config *config = output->config;
+	struct strlist argv = {0};
+	struct objstate state;
+	char *statepath, *cmd, *object;
+	bool loaded, *compiling;
+	size_t first;
+
+	mkdir_p(config->builddir);
+	pch_prepare(config);
+	unity_prepare(config);
+
+	compiling = calloc(config->sources.size + 1, sizeof(bool));
+	for (size_t i = 0; i < config->sources.size; i++) {
+		first = compile_command(config, i, &argv);
+		cmd = strlist_join(&argv, " ");
+		statepath = object_path(config, config->sources.strs[i], ".state");
 
-	removedir(config->builddir);
-	free(thread_tasks);
-	free(threads);
+		loaded = !objstate_load(&state, statepath);
+		if (!loaded || objstate_dirty(&state, hash_str(HASH_INIT, cmd),
+					config->cchash)) {
+			/* Only trust the old hash if nobody touched the object. */
+			object = object_path(config, config->sources.strs[i], ".o");
+			if (file_mtime(object) != state.objmtime)
+				state.objhash = 0;
+			free(object);
+
+			ctx->units[ctx->nunits++] = (struct unit) {
+				.output = index,
+				.source = i,
+				.argv = argv,
+				.rspfirst = first,
+				.cmd = cmd,
+				.statepath = statepath,
+				.edited = !loaded || !state.inputs.size
+					|| file_mtime(config->sources.strs[i]) != state.mtimes[0],
+				.cost = state.time,
+				.rss = state.rss,
+				.objhash = state.objhash,
+				.objmtime = state.objmtime
+			};
+			output->pending++;
+			compiling[i] = true;
+			memset(&argv, 0, sizeof(argv));
+			statepath = cmd = NULL;
+		} else if (config->explain) {
+			printf("up to date: %s\n", config->sources.strs[i]);
+		}
+
+		objstate_free(&state);
+		strlist_free(&argv);
+		free(statepath);
+		free(cmd);
+	}
+
+	link_command(ctx, output, &output->argv);
+	output->statepath = object_path(config, config->out, ".link");
+	if (is_archive(output))
+		check_archive(output, compiling);
+
+	free(compiling);
 }
 
-void split_tasks(struct config *config, struct thread_task *tasks, int n)
+static void check_archive(struct output *output, bool *compiling)
 {
-	int tasks_left, tasks_per_thread, task_index, task_amount;
+	struct config *config = output->config;
+	size_t nobjects = config->sources.size;
+	struct objstate state;
+	char *cmd, *object;
+	bool loaded;
+
+	/* Replacing members keeps the ones of removed sources, so the archive
+	   is created again whenever the list of objects changes. The state has
+	   the objects in order, then the needed outputs & the archive. */
+	cmd = strlist_join(&output->argv, " ");
+	loaded = !objstate_load(&state, output->statepath);
+	output->fresh = !loaded || state.cmdhash != hash_str(HASH_INIT, cmd)
+		|| state.inputs.size != nobjects + output->nneeds + 1
+		|| file_mtime(config->out) != state.mtimes[state.inputs.size - 1];
+	free(cmd);
 
-	tasks_left = config->sources.size % n;
-	tasks_per_thread = (config->sources.size - tasks_left) / n;
+	/* Objects may also have been compiled by a build which failed before
+	   it archived them. */
+	for (size_t i = 0; i < nobjects; i++) {
+		if (compiling[i])
+			continue;
 
-	for (int i = 0; i < n; i++)
-		tasks[i].from = tasks_per_thread;
-	for (int i = 0; i < tasks_left; i++)
-		tasks[i].from++;
+		object = object_path(config, config->sources.strs[i], ".o");
+		if (output->fresh || file_mtime(object) != state.mtimes[i])
+			strlist_append(&output->archive, object);
+		free(object);
+	}
 
-	/* Set the ranges for the tasks. */
-	task_index = 0;
-	for (int i = 0; i < n; i++) {
-		if (i >= (int) config->sources.size) {
-			tasks[i].from = -1;
-			tasks[i].to = -1;
+	if (loaded)
+		objstate_free(&state);
+}
+
+static void plan_archives(struct compile_ctx *ctx)
+{
+	struct output *output;
+	size_t n;
+
+	for (size_t i = 0; i < ctx->noutputs; i++) {
+		output = &ctx->outputs[i];
+		n = output->pending / ARCHIVE_MIN;
+		if (!is_archive(output) || n < 2)
 			continue;
+
+		n = n - 1 < ARCHIVE_BATCHES ? n - 1 : ARCHIVE_BATCHES;
+		output->batchsize = (output->pending + n) / (n + 1);
+
+		ctx->batches = realloc(ctx->batches, sizeof(*ctx->batches)
+				* (ctx->nbatches + n));
+		while (n--)
+			ctx->batches[ctx->nbatches++] = i;
+	}
+
+	ctx->unitbase = ctx->noutputs + ctx->nbatches;
+}
+
+static bool is_archive(struct output *output)
+{
+	return output->kind == OUTPUT_STATIC || output->kind == OUTPUT_THIN;
+}
+
+static pid_t start_job(struct jobqueue *queue, size_t job, int slot)
+{
+	struct compile_ctx *ctx = queue->data;
+
+	if (job < ctx->noutputs)
+		return start_link(ctx, &ctx->outputs[job]);
+	if (job < ctx->unitbase) {
+		return start_archive(ctx, &ctx->outputs[ctx->batches[job
+				- ctx->noutputs]], false);
+	}
+	if (job >= ctx->ppbase)
+		return start_preprocess(ctx, &ctx->units[job - ctx->ppbase]);
+	return start_unit(ctx, &ctx->units[job - ctx->unitbase], slot);
+}
+
+static void finish_job(struct jobqueue *queue, size_t job,
+		struct proc_result *res)
+{
+	struct compile_ctx *ctx = queue->data;
+
+	if (job < ctx->noutputs)
+		finish_link(ctx, &ctx->outputs[job], res);
+	else if (job < ctx->unitbase)
+		finish_archive(&ctx->outputs[ctx->batches[job - ctx->noutputs]], res);
+	else if (job >= ctx->ppbase)
+		finish_preprocess(ctx, &ctx->units[job - ctx->ppbase], res);
+	else
+		finish_unit(ctx, &ctx->units[job - ctx->unitbase], res);
+}
+
+static int ready_job(struct jobqueue *queue, size_t job)
+{
+	struct compile_ctx *ctx = queue->data;
+	struct output *output, *need;
+
+	/* The preprocessing is not needed for every unit, but its unit waits
+	   until it is done. */
+	if (job >= ctx->ppbase)
+		return ctx->units[job - ctx->ppbase].preprocess ? 1 : -1;
+	if (job >= ctx->unitbase)
+		return !ctx->units[job - ctx->unitbase].preprocess;
+
+	/* A batch waits for enough objects, and is not needed anymore once
+	   the last ar can run. */
+	if (job >= ctx->noutputs) {
+		output = &ctx->outputs[ctx->batches[job - ctx->noutputs]];
+		if (output->failed || !output->pending)
+			return -1;
+		return !output->archiving
+			&& output->archive.size >= output->batchsize;
+	}
+
+	/* Don't link against stale objects of the sources that failed, or an
+	   old version of a needed output. */
+	output = &ctx->outputs[job];
+	if (output->failed)
+		return -1;
+	if (output->pending || output->archiving)
+		return 0;
+
+	for (size_t i = 0; i < output->nneeds; i++) {
+		need = &ctx->outputs[output->needs[i]];
+		if (need->failed) {
+			output->failed = true;
+			return -1;
+		}
+		if (!need->done)
+			return 0;
+	}
+
+	return 1;
+}
+
+static pid_t start_unit(struct compile_ctx *ctx, struct unit *unit, int slot)
+{
+	struct config *config = ctx->outputs[unit->output].config;
+	double started;
+	char *source;
+
+	source = config->sources.strs[unit->source];
+
+	if (config->explain)
+		printf("T%d : %s\n", slot, source);
+	if (config->explain)
+		printf("issuing: '%s'\n", unit->cmd);
+
+	printf("\033[2K\r[%zu/%zu] Compiling %s...", ++ctx->nstarted, ctx->nunits,
+			source);
+	fflush(stdout);
+
+	/* Remove the old object & state first, so a failed compile cannot
+	   leave a stale object behind that looks up to date. */
+	unit->object = object_path(config, source, ".o");
+	unit->depfile = object_path(config, source, ".d");
+	unit->log = object_path(config, source, ".log");
+	unlink(unit->statepath);
+	unlink(unit->object);
+
+	unit->state.cmdhash = hash_str(HASH_INIT, unit->cmd);
+	unit->state.cchash = config->cchash;
+
+	unit_key(ctx, unit);
+	/* A cache hit says nothing about the compile time, so keep the
+	   previous one. */
+	unit->state.time = unit->cost;
+	unit->state.rss = unit->rss;
+
+	started = clock_now();
+	if (unit->key && cache_fetch(config, unit->key, source, unit->object,
+				&unit->state)) {
+		trace_span(source, "cached", 0, started, clock_now());
+		objstate_set_output(&unit->state, unit->object, unit->objhash,
+				unit->objmtime);
+		objstate_save(&unit->state, unit->statepath);
+		finish_unit(ctx, unit, NULL);
+		return 0;
+	}
+
+	/* Capture the warnings, so they can be replayed on a cache hit. The
+	   log may be hardlinked into the cache, so don't overwrite it. */
+	if (config->cache)
+		unlink(unit->log);
+
+	/* The inputs are stat'ed before the compiler reads them, so a change
+	   while it runs is noticed by the next build. The headers are only
+	   known afterwards, and checked against the time it started. */
+	objstate_add_input(&unit->state, source);
+	for (size_t i = 0; i < config->pchinputs.size; i++)
+		objstate_add_input(&unit->state, config->pchinputs.strs[i]);
+	unit->since = file_clock();
+
+	/* A unit which can't be compiled remotely runs here, even in a remote
+	   slot. */
+	if (slot >= ctx->nlocal) {
+		unit->pid = start_remote(ctx, unit,
+				&ctx->workers[ctx->slotworkers[slot - ctx->nlocal]]);
+		if (unit->pid)
+			return unit->pid;
+	}
+
+	unit->pid = spawn_rsp(config, &unit->argv, unit->rspfirst,
+			unit->argv.size, unit->object, config->cache ? unit->log : NULL);
+
+	return unit->pid;
+}
+
+static pid_t start_preprocess(struct compile_ctx *ctx, struct unit *unit)
+{
+	struct config *config = ctx->outputs[unit->output].config;
+	char *source = config->sources.strs[unit->source];
+	pid_t pid;
+
+	unit->preprocessed = object_path(config, source, ".i");
+	pid = cache_preprocess(config, source, unit->preprocessed);
+	if (pid > 0)
+		return pid;
+
+	/* The source is compiled without the cache then. */
+	free(unit->preprocessed);
+	unit->preprocessed = NULL;
+	unit->preprocess = false;
+	return 0;
+}
+
+static void finish_preprocess(struct compile_ctx *ctx, struct unit *unit,
+		struct proc_result *res)
+{
+	struct config *config = ctx->outputs[unit->output].config;
+	char *source = config->sources.strs[unit->source];
+
+	trace_span(source, "preprocess", res->slot + 1, res->start,
+			res->start + res->wall);
+
+	/* A failed preprocessor may leave half an output, which is no key. */
+	unit->key = res->status ? 0 : cache_key(config, source, unit->cmd,
+			unit->preprocessed);
+	unit->keyed = true;
+
+	unlink(unit->preprocessed);
+	free(unit->preprocessed);
+	unit->preprocessed = NULL;
+	unit->preprocess = false;
+}
+
+static uint64_t unit_key(struct compile_ctx *ctx, struct unit *unit)
+{
+	struct config *config = ctx->outputs[unit->output].config;
+
+	/* Compilers without depfiles get their key from the preprocessor. */
+	if (!unit->keyed && config->cache && config->ccfamily != CC_OTHER) {
+		unit->key = cache_key(config, config->sources.strs[unit->source],
+				unit->cmd, NULL);
+	}
+
+	unit->keyed = true;
+	return unit->key;
+}
+
+static int plan_workers(struct compile_ctx *ctx)
+{
+	long *current, best;
+	int total = 0;
+	size_t w;
+
+	ctx->nworkers = remote_probe(ctx->config, &ctx->workers);
+	for (size_t i = 0; i < ctx->nworkers; i++)
+		total += ctx->workers[i].slots;
+
+	/* Interleave the slots of the workers by their weight, so with fewer
+	   jobs than slots, each worker still gets its share. The slots are
+	   filled in order. */
+	ctx->slotworkers = calloc(total + 1, sizeof(*ctx->slotworkers));
+	current = calloc(ctx->nworkers + 1, sizeof(*current));
+	for (int s = 0; s < total; s++) {
+		w = 0;
+		best = LONG_MIN;
+		for (size_t i = 0; i < ctx->nworkers; i++) {
+			current[i] += ctx->workers[i].slots;
+			if (current[i] > best) {
+				best = current[i];
+				w = i;
+			}
 		}
-		task_amount = tasks[i].from;
-		tasks[i].from = task_index;
-		task_index += task_amount;
-		tasks[i].to = task_index - 1;
+
+		current[w] -= total;
+		ctx->slotworkers[s] = w;
 	}
 
+	free(current);
+	return total;
+}
+
+static pid_t start_remote(struct compile_ctx *ctx, struct unit *unit,
+		struct worker *worker)
+{
+	struct config *config = ctx->outputs[unit->output].config;
+	struct strlist pre = {0}, cc = {0}, argv = {0};
+	char *source = config->sources.strs[unit->source];
+
+	/* The source is preprocessed by gcc or clang here, and a clang pch
+	   cannot be included as text. */
+	if (config->ccfamily == CC_OTHER || needs_shell(config)
+			|| (config->ccfamily == CC_CLANG && config->pchflags.size))
+		return 0;
+
+	strsplit(&pre, config->cc);
+	strlist_append(&pre, "-E");
+	strlist_append(&pre, source);
+	strlist_append(&pre, "-MMD");
+	strlist_append(&pre, "-MF");
+	strlist_append(&pre, unit->depfile);
+	strlist_append(&pre, "-MT");
+	strlist_append(&pre, unit->object);
+	for (size_t i = 0; i < config->pchflags.size; i++)
+		strlist_append(&pre, config->pchflags.strs[i]);
+	for (size_t i = 0; i < config->flags.size; i++)
+		strlist_append(&pre, config->flags.strs[i]);
+
+	strsplit(&cc, config->cc);
+	strlist_append(&cc, "-c");
+	for (size_t i = 0; i < config->flags.size; i++)
+		strlist_append(&cc, config->flags.strs[i]);
+
+	remote_command(worker->addr, source, unit->object, &pre, &cc, &argv);
+	if (config->explain)
+		printf("remote: %s on %s\n", source, worker->addr);
+
+	unit->remote = true;
+	unit->pid = spawn_cmd(&argv, false, config->cache ? unit->log : NULL);
+
+	strlist_free(&pre);
+	strlist_free(&cc);
+	strlist_free(&argv);
+	return unit->pid;
+}
+
+static void finish_unit(struct compile_ctx *ctx, struct unit *unit,
+		struct proc_result *res)
+{
+	struct output *output = &ctx->outputs[unit->output];
+	struct config *config = output->config;
+	bool unchanged = false;
+
+	/* Without a result, the unit was finished by the cache. */
+	unit->pid = 0;
+	output->pending--;
+	if (!res)
+		goto archive;
+
+	trace_span(config->sources.strs[unit->source], "compile", res->slot + 1,
+			res->start, res->start + res->wall);
+
 	if (config->explain) {
-		for (int i = 0; i < n; i++) {
-			if (tasks[i].from == -1)
-				break;
-			printf("thread %d : %d,%d (%d tasks)\n", i, tasks[i].from,
-					tasks[i].to, tasks[i].to - tasks[i].from + 1);
+		printf("finished: %s (status %d, %.2fs, %.2fs cpu, %ld KiB)\n",
+				config->sources.strs[unit->source], res->status, res->wall,
+				res->cpu, res->maxrss);
+	}
+
+	if (config->cache)
+		cat_file(unit->log, stderr);
+	if (res->status) {
+		output->failed = true;
+		ctx->failed_units++;
+		goto end;
+	}
+
+	/* The helper of a remote compile uses no memory worth noting. */
+	unit->state.time = res->wall;
+	if (!unit->remote)
+		unit->state.rss = res->maxrss;
+
+	/* The depfile stays next to the object, but its contents are copied
+	   into the state so checking doesn't have to parse it. An object which
+	   may have seen a half-edited header is not cached. */
+	if (config->ccfamily != CC_OTHER && objstate_read_depfile(&unit->state,
+				unit->depfile, unit->since) < 0)
+		unit->key = 0;
+
+	/* The entry is stored first, so it keeps the new mtime if the object
+	   gets the old one. */
+	if (unit->key)
+		cache_store(config, unit->key, unit->object, unit->log, &unit->state);
+
+	unchanged = objstate_set_output(&unit->state, unit->object,
+			unit->objhash, unit->objmtime);
+	if (unchanged && config->explain)
+		printf("unchanged: %s\n", config->sources.strs[unit->source]);
+
+	objstate_save(&unit->state, unit->statepath);
+
+archive:
+	if (is_archive(output) && (output->fresh || !unchanged))
+		strlist_append(&output->archive, unit->object);
+
+end:
+	objstate_free(&unit->state);
+	free(unit->object);
+	free(unit->depfile);
+	free(unit->log);
+	unit->object = unit->depfile = unit->log = NULL;
+}
+
+static bool admit_job(struct jobqueue *queue, size_t job, size_t *running,
+		int nrunning)
+{
+	struct compile_ctx *ctx = queue->data;
+	struct unit *unit;
+	pid_t *pids;
+	long *rss;
+	bool admit;
+
+	/* Links & archives are not limited, they are only a few, and neither
+	   is the preprocessor. A unit in the cache starts no compiler. */
+	if (job < ctx->unitbase || job >= ctx->ppbase)
+		return true;
+
+	unit = &ctx->units[job - ctx->unitbase];
+	if (unit_key(ctx, unit) && cache_contains(ctx->outputs[unit->output]
+				.config, unit->key))
+		return true;
+
+	pids = malloc(sizeof(*pids) * nrunning);
+	rss = malloc(sizeof(*rss) * nrunning);
+	for (int i = 0; i < nrunning; i++) {
+		if (running[i] < ctx->unitbase || running[i] >= ctx->ppbase) {
+			pids[i] = 0;
+			rss[i] = 0;
+			continue;
 		}
+
+		pids[i] = ctx->units[running[i] - ctx->unitbase].pid;
+		rss[i] = ctx->units[running[i] - ctx->unitbase].rss;
 	}
+
+	admit = limits_admit(ctx->config, unit->rss, pids, rss, nrunning);
+
+	free(pids);
+	free(rss);
+	return admit;
 }
 
-void *run_thread_task(struct thread_task *task)
+static pid_t start_link(struct compile_ctx *ctx, struct output *output)
 {
-	char cmd[LINESIZE];
-	char *changed_path;
+	struct config *config = output->config;
+	struct strlist *argv = &output->argv, jobs = {0};
+	char *cmd;
+	pid_t pid;
+
+	if (is_archive(output))
+		return start_archive(ctx, output, true);
+
+	cmd = strlist_join(&output->argv, " ");
+	if (!link_outdated(config, output->statepath, hash_str(HASH_INIT, cmd))) {
+		printf("\033[2K\rbuild: '%s' is up to date\n", config->out);
+		output->done = true;
+		free(cmd);
+		return 0;
+	}
 
-	for (int i = task->from; i <= task->to; i++) {
-		if (task->config->explain)
-			printf("T%d : %s\n", task->tid, task->config->sources.strs[i]);
+	printf("\033[2K\r[%zu/%zu] Linking %s...", ctx->nstarted, ctx->nunits,
+			config->out);
+	fflush(stdout);
+
+	/* The LTO jobs are only in the command we run, not the one in the
+	   state. */
+	if (lto_enabled(config)) {
+		for (size_t i = 0; i < output->argv.size; i++)
+			strlist_append(&jobs, output->argv.strs[i]);
+		output->ltotokens = lto_link_jobs(config, &jobs);
+		argv = &jobs;
+		free(cmd);
+		cmd = strlist_join(argv, " ");
+	}
+
+	if (config->explain)
+		printf("linking: %s\n", cmd);
 
-		/* Replace the slashes with another char so we don't have to create
-		   any directories. */
-		changed_path = strdup(task->config->sources.strs[i]);
-		strreplace(changed_path, '/', '-');
+	unlink(output->statepath);
+	pid = spawn_rsp(config, argv, output->objfirst, output->objlast,
+			output->statepath, NULL);
+	if (pid == -1) {
+		for (; output->ltotokens; output->ltotokens--)
+			jobserver_release();
+		output->failed = true;
+	}
+
+	ctx->linked = true;
+	strlist_free(&jobs);
+	free(cmd);
+	return pid;
+}
+
+static void finish_link(struct compile_ctx *ctx, struct output *output,
+		struct proc_result *res)
+{
+	struct config *config = output->config;
+	struct objstate state = {0};
+	char *cmd;
+
+	if (is_archive(output)) {
+		finish_archive(output, res);
+		if (output->failed)
+			return;
+	} else {
+		trace_span(config->out, "link", res->slot + 1, res->start,
+				res->start + res->wall);
+
+		for (; output->ltotokens; output->ltotokens--)
+			jobserver_release();
+
+		if (config->explain) {
+			printf("linked: %s (status %d, %.2fs, %.2fs cpu, %ld KiB)\n",
+					config->out, res->status, res->wall, res->cpu,
+					res->maxrss);
+		}
 
-		/* Construct the compile command. */
-		snprintf(cmd, LINESIZE, "%s -c -o %s/%s.o %s ", task->config->cc,
-				task->config->builddir, changed_path,
-				task->config->sources.strs[i]);
-		for (size_t i = 0; i < task->config->flags.size; i++) {
-			strcat(cmd, " ");
-			strcat(cmd, task->config->flags.strs[i]);
+		if (res->status) {
+			fprintf(stderr, "\nbuild: linking %s failed\n", config->out);
+			output->failed = true;
+			return;
 		}
+	}
+
+	/* Remember what went into the output, including the output itself, so
+	   deleting or replacing it also relinks. The objects & needed outputs
+	   are all arguments of the command, the output is the one after -o. */
+	cmd = strlist_join(&output->argv, " ");
+	state.cmdhash = hash_str(HASH_INIT, cmd);
+	state.cchash = config->cchash;
+	free(cmd);
+
+	for (size_t i = 0; i < config->sources.size; i++) {
+		cmd = object_path(config, config->sources.strs[i], ".o");
+		objstate_add_input(&state, cmd);
+		free(cmd);
+	}
+
+	for (size_t i = 0; i < output->nneeds; i++) {
+		objstate_add_input(&state,
+				ctx->outputs[output->needs[i]].config->out);
+	}
+
+	objstate_add_input(&state, config->out);
+	objstate_save(&state, output->statepath);
+	objstate_free(&state);
+	output->done = true;
+}
+
+static pid_t start_archive(struct compile_ctx *ctx, struct output *output,
+		bool final)
+{
+	struct config *config = output->config;
+	struct strlist argv = {0};
+	size_t first;
+	pid_t pid;
 
-		if (task->config->explain)
-			printf("issuing: '%s'\n", cmd);
+	if (!final && !output->archive.size)
+		return 0;
 
-		printf("\033[2K\r[%d/%zu] Compiling %s...", i+1,
-				task->config->sources.size, task->config->sources.strs[i]);
+	if (final && !output->fresh && !output->touched
+			&& !output->archive.size) {
+		printf("\033[2K\rbuild: '%s' is up to date\n", config->out);
+		output->done = true;
+		return 0;
+	}
+
+	/* Until the last ar succeeds, the state is gone, so a failed build
+	   creates the archive again. */
+	if (!output->touched) {
+		unlink(output->statepath);
+		if (output->fresh)
+			unlink(config->out);
+		output->touched = true;
+	}
 
+	archive_command(config, final, &argv);
+	first = argv.size;
+	for (size_t i = 0; i < output->archive.size; i++)
+		strlist_append(&argv, output->archive.strs[i]);
+	strlist_free(&output->archive);
+
+	if (final) {
+		printf("\033[2K\r[%zu/%zu] Archiving %s...", ctx->nstarted,
+				ctx->nunits, config->out);
 		fflush(stdout);
-		system(cmd);
-		free(changed_path);
 	}
 
-	return NULL;
+	if (config->explain) {
+		printf("archiving: %s (%zu objects%s)\n", config->out,
+				argv.size - first, final ? ", symbol table" : "");
+	}
+
+	pid = spawn_rsp(config, &argv, first, argv.size, output->statepath,
+			NULL);
+	strlist_free(&argv);
+
+	if (pid == -1)
+		output->failed = true;
+	output->archiving = pid > 0;
+	ctx->linked = true;
+	return pid;
 }
 
-void link_object_files(struct config *config)
+static void finish_archive(struct output *output, struct proc_result *res)
 {
-	struct strlist objects = {0};
-	char cmd[LINESIZE];
+	struct config *config = output->config;
 
-	find(&objects, 'f', config->builddir, "*.o");
+	output->archiving = false;
+	trace_span(config->out, "archive", res->slot + 1, res->start,
+			res->start + res->wall);
 
-	snprintf(cmd, LINESIZE, "%s -o %s", config->cc, config->out);
-	for (size_t i = 0; i < objects.size; i++) {
-		strcat(cmd, " ");
-		strcat(cmd, objects.strs[i]);
+	if (config->explain) {
+		printf("archived: %s (status %d, %.2fs)\n", config->out,
+				res->status, res->wall);
 	}
 
-	for (size_t i = 0; i < config->libraries.size; i++) {
-		strcat(cmd, " -l");
-		strcat(cmd, config->libraries.strs[i]);
+	if (res->status) {
+		fprintf(stderr, "\nbuild: archiving %s failed\n", config->out);
+		output->failed = true;
 	}
+}
 
-	for (size_t i = 0; i < config->flags.size; i++) {
-		strcat(cmd, " ");
-		strcat(cmd, config->flags.strs[i]);
+static void archive_command(struct config *config, bool index,
+		struct strlist *argv)
+{
+	/* "S" leaves out the symbol table, and "T" only stores the paths of
+	   the objects. */
+	strsplit(argv, lto_archiver(config));
+	if (output_kind(config) == OUTPUT_THIN)
+		strlist_append(argv, index ? "rcsT" : "rcST");
+	else
+		strlist_append(argv, index ? "rcs" : "rcS");
+	strlist_append(argv, config->out);
+}
+
+static void link_command(struct compile_ctx *ctx, struct output *output,
+		struct strlist *argv)
+{
+	struct config *config = output->config;
+	struct output *need;
+	char *object;
+
+	/* Link the objects in the order of the sources, instead of everything
+	   that happens to be in the build directory, so the output does not
+	   depend on the order of the directory. */
+
+	if (is_archive(output)) {
+		archive_command(config, true, argv);
+	} else {
+		strsplit(argv, config->cc);
+		if (output->kind == OUTPUT_SHARED)
+			strlist_append(argv, "-shared");
+		strlist_append(argv, "-o");
+		strlist_append(argv, config->out);
 	}
 
-	printf("\033[2K\r[%zu/%zu] Linking...", config->sources.size,
-			config->sources.size);
+	output->objfirst = argv->size;
+	for (size_t i = 0; i < config->sources.size; i++) {
+		object = object_path(config, config->sources.strs[i], ".o");
+		strlist_append(argv, object);
+		free(object);
+	}
+	output->objlast = argv->size;
 
-	if (config->explain)
-		printf("linking: %s\n", cmd);
-	system(cmd);
+	/* An archive only holds its own objects. */
+	if (is_archive(output))
+		return;
+
+	/* Needed outputs which are executables are only built before. */
+	for (size_t i = 0; i < output->nneeds; i++) {
+		need = &ctx->outputs[output->needs[i]];
+		if (need->kind != OUTPUT_EXECUTABLE
+				|| strstr(need->config->out, ".so"))
+			strlist_append(argv, need->config->out);
+	}
+
+	for (size_t i = 0; i < config->libraries.size; i++)
+		strlist_appendf(argv, "-l%s", config->libraries.strs[i]);
+
+	for (size_t i = 0; i < config->flags.size; i++)
+		strlist_append(argv, config->flags.strs[i]);
+
+	lto_link_flags(config, argv);
+}
+
+static pid_t spawn_rsp(struct config *config, struct strlist *argv,
+		size_t first, size_t last, char *path, char *errlog)
+{
+	bool shell = needs_shell(config);
+	struct strlist shortened;
+	char *rsppath;
+	pid_t pid;
+
+	/* Only gcc & clang are known to read response files. The objects of a
+	   link never need the shell, but compiler flags may, and the shell does
+	   not expand anything in the response file. */
+	if (config->ccfamily == CC_OTHER || (last == argv->size && shell))
+		return spawn_cmd(argv, shell, errlog);
+
+	rsppath = malloc(strlen(path) + 5);
+	sprintf(rsppath, "%s.rsp", path);
+
+	if (rspfile_args(argv, first, last, rsppath, &shortened)) {
+		if (config->explain)
+			printf("response file: %s\n", rsppath);
+		pid = spawn_cmd(&shortened, shell, errlog);
+		strlist_free(&shortened);
+	} else {
+		pid = spawn_cmd(argv, shell, errlog);
+	}
+
+	free(rsppath);
+	return pid;
+}
+
+static size_t compile_command(struct config *config, size_t index,
+		struct strlist *argv)
+{
+	char *source = config->sources.strs[index];
+	size_t first;
+	char *path;
+
+	strsplit(argv, config->cc);
+	first = argv->size;
+	strlist_append(argv, "-c");
+	strlist_append(argv, "-o");
+	path = object_path(config, source, ".o");
+	strlist_append(argv, path);
+	free(path);
+	strlist_append(argv, source);
+
+	/* Let gcc & clang tell us which headers the object depends on. */
+	if (config->ccfamily != CC_OTHER) {
+		path = object_path(config, source, ".d");
+		strlist_append(argv, "-MMD");
+		strlist_append(argv, "-MF");
+		strlist_append(argv, path);
+		free(path);
+	}
+
+	for (size_t i = 0; i < config->pchflags.size; i++)
+		strlist_append(argv, config->pchflags.strs[i]);
+
+	for (size_t i = 0; i < config->flags.size; i++)
+		strlist_append(argv, config->flags.strs[i]);
+
+	return first;
+}
+
+static bool link_outdated(struct config *config, char *statepath,
+		uint64_t cmdhash)
+{
+	struct objstate state;
+	bool outdated;
+
+	/* The recorded mtimes are compared for equality, like the inputs of an
+	   object. Objects which were recompiled to the same bytes keep their old
+	   mtime, so they don't cause a relink. */
+
+	if (objstate_load(&state, statepath))
+		return true;
+
+	outdated = objstate_dirty(&state, cmdhash, config->cchash);
+	if (outdated && config->explain)
+		printf("link outdated: %s\n", config->out);
+
+	objstate_free(&state);
+	return outdated;
+}
+
+static double schedule_units(struct unit *units, size_t n, int nslots)
+{
+	double total = 0, makespan = 0, *slots;
+	size_t known = 0, rss_known = 0;
+	long long rss_total = 0;
+	int min;
+
+	/* Sources without a recorded time & memory are guessed to take the
+	   average. */
+	for (size_t i = 0; i < n; i++) {
+		if (units[i].cost > 0) {
+			total += units[i].cost;
+			known++;
+		}
+		if (units[i].rss > 0) {
+			rss_total += units[i].rss;
+			rss_known++;
+		}
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		if (units[i].cost <= 0 && known)
+			units[i].cost = total / known;
+		if (units[i].rss <= 0 && rss_known)
+			units[i].rss = rss_total / rss_known;
+	}
+
+	qsort(units, n, sizeof(*units), cmp_unit);
+
+	/* Predict the makespan by handing each job to the slot which gets
+	   free first, like jobs_run() does. */
+	slots = calloc(nslots, sizeof(*slots));
+	for (size_t i = 0; i < n; i++) {
+		min = 0;
+		for (int j = 1; j < nslots; j++) {
+			if (slots[j] < slots[min])
+				min = j;
+		}
+
+		slots[min] += units[i].cost;
+		if (slots[min] > makespan)
+			makespan = slots[min];
+	}
+
+	free(slots);
+	return makespan;
+}
+
+static int cmp_unit(const void *a, const void *b)
+{
+	const struct unit *ua = a, *ub = b;
 
-	printf("\033[2K\r[%zu/%zu] Done\n", config->sources.size,
-		config->sources.size);
+	if (ua->edited != ub->edited)
+		return ub->edited - ua->edited;
+	if (ua->cost != ub->cost)
+		return ua->cost < ub->cost ? 1 : -1;
 
-	strlist_free(&objects);
+	/* Keep the order of the sources otherwise. */
+	if (ua->output != ub->output)
+		return ua->output > ub->output ? 1 : -1;
+	return (ua->source > ub->source) - (ua->source < ub->source);
 }
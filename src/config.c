@@ -16,23 +16,77 @@ void config_free(struct config *config)
 	free(config->buildfile);
 	free(config->builddir);
 	free(config->out);
+	free(config->kind);
+	free(config->ar);
+	free(config->lto);
 	free(config->cc);
+	free(config->cache);
+	free(config->cachesize_str);
+	free(config->maxload_str);
+	free(config->maxmem_str);
+	free(config->maxpressure_str);
+	free(config->pch);
+	strlist_free(&config->pchflags);
+	strlist_free(&config->pchinputs);
+	free(config->unity);
+	strlist_free(&config->unityexclude);
+	strlist_free(&config->workers);
 
 	for (size_t i = 0; i < config->ntargets; i++) {
 		strlist_free(&config->targets[i]->cmds);
+		strlist_free(&config->targets[i]->needs);
 		free(config->targets[i]);
 	}
 	free(config->targets);
 
+	for (size_t i = 0; i < config->nartifacts; i++) {
+		strlist_free(&config->artifacts[i]->sources);
+		strlist_free(&config->artifacts[i]->flags);
+		strlist_free(&config->artifacts[i]->libraries);
+		strlist_free(&config->artifacts[i]->needs);
+		free(config->artifacts[i]->out);
+		free(config->artifacts[i]->kind);
+		free(config->artifacts[i]);
+	}
+	free(config->artifacts);
+
+	for (size_t i = 0; i < config->nvariants; i++) {
+		strlist_free(&config->variants[i]->flags);
+		free(config->variants[i]->cc);
+		free(config->variants[i]->out);
+		free(config->variants[i]->builddir);
+		free(config->variants[i]);
+	}
+	free(config->variants);
+	strlist_free(&config->called_variants);
+
 	memset(config, 0, sizeof(*config));
 }
 
 void config_dump(struct config *config)
 {
+	struct artifact *a;
+	struct variant *v;
 	struct target *t;
 
 	printf("cc:        %s\nbuildfile: %s\nbuilddir:  %s\nout:       %s\n",
 		config->cc, config->buildfile, config->builddir, config->out);
+	if (config->kind)
+		printf("kind:      %s\n", config->kind);
+	if (config->lto)
+		printf("lto:       %s\n", config->lto);
+	if (config->cache)
+		printf("cache:     %s (%s)\n", config->cache, config->cachesize_str);
+	if (config->pch)
+		printf("pch:       %s\n", config->pch);
+	if (config->unity)
+		printf("unity:     %s\n", config->unity);
+	if (config->maxload_str)
+		printf("maxload:   %s\n", config->maxload_str);
+	if (config->maxmem_str)
+		printf("maxmem:    %s\n", config->maxmem_str);
+	if (config->maxpressure_str)
+		printf("maxpressure: %s\n", config->maxpressure_str);
 
 	puts("sources:");
 	for (size_t i = 0; i < config->sources.size; i++)
@@ -54,9 +108,33 @@ void config_dump(struct config *config)
 	for (size_t i = 0; i < config->ntargets; i++) {
 		t = config->targets[i];
 		printf("  @%s:\n", config->targets[i]->name);
+		for (size_t j = 0; j < t->needs.size; j++)
+			printf("    needs %s\n", t->needs.strs[j]);
 		for (size_t j = 0; j < t->cmds.size; j++)
 			printf("    %s\n", t->cmds.strs[j]);
 	}
+
+	if (config->nartifacts)
+		puts("artifacts:");
+	for (size_t i = 0; i < config->nartifacts; i++) {
+		a = config->artifacts[i];
+		printf("  %s -> %s%s%s\n", a->name, a->out, a->kind ? ", " : "",
+				a->kind ? a->kind : "");
+		for (size_t j = 0; j < a->sources.size; j++)
+			printf("    %s\n", a->sources.strs[j]);
+		for (size_t j = 0; j < a->needs.size; j++)
+			printf("    needs %s\n", a->needs.strs[j]);
+	}
+
+	if (config->nvariants)
+		puts("variants:");
+	for (size_t i = 0; i < config->nvariants; i++) {
+		v = config->variants[i];
+		printf("  %s%s%s\n", v->name, v->cc ? ", cc " : "",
+				v->cc ? v->cc : "");
+		for (size_t j = 0; j < v->flags.size; j++)
+			printf("    %s\n", v->flags.strs[j]);
+	}
 }
 
 struct target *config_add_target(struct config *config, char *name)
@@ -71,6 +149,7 @@ struct target *config_add_target(struct config *config, char *name)
 
 	strcpy(t->name, name);
 	memset(&t->cmds, 0, sizeof(t->cmds));
+	memset(&t->needs, 0, sizeof(t->needs));
 
 	return t;
 }
@@ -88,6 +167,212 @@ int config_add_target_command(struct config *config, char *name, char *cmd)
 	return 0;
 }
 
+struct artifact *config_add_artifact(struct config *config, char *name)
+{
+	struct artifact *a;
+
+	config->artifacts = realloc(config->artifacts, (config->nartifacts + 1)
+			* sizeof(struct artifact *));
+	config->artifacts[config->nartifacts] = calloc(1, sizeof(struct artifact)
+			+ strlen(name) + 1);
+	a = config->artifacts[config->nartifacts++];
+
+	strcpy(a->name, name);
+	return a;
+}
+
+size_t config_find_artifact(struct config *config, char *name)
+{
+	for (size_t i = 0; i < config->nartifacts; i++) {
+		if (strcmp(config->artifacts[i]->name, name) == 0)
+			return i;
+	}
+
+	return INVALID_INDEX;
+}
+
+void config_artifact(struct config *config, struct artifact *artifact,
+		struct config *out)
+{
+	size_t len;
+
+	/* Only the sources, flags, libraries, output & build directory are
+	   owned by the artifact config, the rest points into `config`. */
+	*out = *config;
+	memset(&out->sources, 0, sizeof(out->sources));
+	memset(&out->flags, 0, sizeof(out->flags));
+	memset(&out->libraries, 0, sizeof(out->libraries));
+	memset(&out->pchflags, 0, sizeof(out->pchflags));
+	memset(&out->pchinputs, 0, sizeof(out->pchinputs));
+	out->artifacts = NULL;
+	out->nartifacts = 0;
+	if (!out->topbuilddir)
+		out->topbuilddir = config->builddir;
+
+	for (size_t i = 0; i < config->flags.size; i++)
+		strlist_append(&out->flags, config->flags.strs[i]);
+	for (size_t i = 0; i < config->libraries.size; i++)
+		strlist_append(&out->libraries, config->libraries.strs[i]);
+
+	/* Without an artifact, this is the main output. */
+	if (!artifact) {
+		out->out = strdup(config->out);
+		out->builddir = strdup(config->builddir);
+		for (size_t i = 0; i < config->sources.size; i++)
+			strlist_append(&out->sources, config->sources.strs[i]);
+		return;
+	}
+
+	out->name = artifact->name;
+	out->kind = artifact->kind;
+
+	/* The artifacts of a variant go into a directory named after it, like
+	   its main output. */
+	if (config->variant) {
+		len = strlen(config->variant) + strlen(artifact->out) + 2;
+		out->out = malloc(len);
+		snprintf(out->out, len, "%s/%s", config->variant, artifact->out);
+	} else {
+		out->out = strdup(artifact->out);
+	}
+
+	/* Each artifact gets its own directory for the objects, as the same
+	   source may be compiled with different flags. */
+	len = strlen(config->builddir) + strlen(artifact->name) + 2;
+	out->builddir = malloc(len);
+	snprintf(out->builddir, len, "%s/%s", config->builddir, artifact->name);
+
+	for (size_t i = 0; i < artifact->sources.size; i++)
+		strlist_append(&out->sources, artifact->sources.strs[i]);
+	for (size_t i = 0; i < artifact->flags.size; i++)
+		strlist_append(&out->flags, artifact->flags.strs[i]);
+	for (size_t i = 0; i < artifact->libraries.size; i++)
+		strlist_append(&out->libraries, artifact->libraries.strs[i]);
+}
+
+struct variant *config_add_variant(struct config *config, char *name)
+{
+	struct variant *v;
+
+	config->variants = realloc(config->variants, (config->nvariants + 1)
+			* sizeof(struct variant *));
+	config->variants[config->nvariants] = calloc(1, sizeof(struct variant)
+			+ strlen(name) + 1);
+	v = config->variants[config->nvariants++];
+
+	strcpy(v->name, name);
+	return v;
+}
+
+size_t config_find_variant(struct config *config, char *name)
+{
+	for (size_t i = 0; i < config->nvariants; i++) {
+		if (strcmp(config->variants[i]->name, name) == 0)
+			return i;
+	}
+
+	return INVALID_INDEX;
+}
+
+void config_variant(struct config *config, struct variant *variant,
+		struct config *out)
+{
+	size_t len;
+
+	/* Owns the same things as an artifact config, and keeps the artifacts
+	   to build them in the variant. */
+	config_artifact(config, NULL, out);
+	out->artifacts = config->artifacts;
+	out->nartifacts = config->nartifacts;
+	out->variant = variant->name;
+
+	for (size_t i = 0; i < variant->flags.size; i++)
+		strlist_append(&out->flags, variant->flags.strs[i]);
+
+	if (variant->cc) {
+		out->cc = variant->cc;
+		out->cchash = variant->cchash;
+		out->ccfamily = variant->ccfamily;
+	}
+
+	free(out->builddir);
+	if (variant->builddir) {
+		out->builddir = strdup(variant->builddir);
+	} else {
+		len = strlen(config->builddir) + strlen(variant->name) + 2;
+		out->builddir = malloc(len);
+		snprintf(out->builddir, len, "%s/%s", config->builddir,
+				variant->name);
+	}
+
+	free(out->out);
+	if (variant->out) {
+		out->out = strdup(variant->out);
+	} else {
+		len = strlen(variant->name) + strlen(config->out) + 2;
+		out->out = malloc(len);
+		snprintf(out->out, len, "%s/%s", variant->name, config->out);
+	}
+}
+
+void config_artifact_free(struct config *config)
+{
+	strlist_free(&config->sources);
+	strlist_free(&config->flags);
+	strlist_free(&config->libraries);
+	strlist_free(&config->pchflags);
+	strlist_free(&config->pchinputs);
+	free(config->builddir);
+	free(config->out);
+}
+
+static bool in_dir(char *path, char *dir)
+{
+	size_t len = strlen(dir);
+
+	return !strncmp(path, dir, len) && path[len] == '/';
+}
+
+bool config_in_builddir(struct config *config, char *path)
+{
+	while (path[0] == '.' && path[1] == '/')
+		path += 2;
+
+	if (in_dir(path, config->builddir) || (config->topbuilddir
+				&& in_dir(path, config->topbuilddir)))
+		return true;
+
+	/* Variants without a builddir use one below the global builddir. */
+	for (size_t i = 0; i < config->nvariants; i++) {
+		if (config->variants[i]->builddir
+				&& in_dir(path, config->variants[i]->builddir))
+			return true;
+	}
+
+	return false;
+}
+
+enum output_kind output_kind(struct config *config)
+{
+	const char *kinds[] = {"executable", "static", "thin", "shared"};
+	size_t len;
+
+	if (config->kind) {
+		for (size_t i = 0; i < sizeof(kinds) / sizeof(*kinds); i++) {
+			if (!strcmp(config->kind, kinds[i]))
+				return (enum output_kind) i;
+		}
+		return OUTPUT_UNKNOWN;
+	}
+
+	/* An output called "lib.so" used to get -shared from the flags, so
+	   only ".a" is taken from the name. */
+	len = strlen(config->out);
+	if (len > 2 && !strcmp(config->out + len - 2, ".a"))
+		return OUTPUT_STATIC;
+	return OUTPUT_EXECUTABLE;
+}
+
 size_t config_find_target(struct config *config, char *name)
 {
 	for (size_t i = 0; i < config->ntargets; i++) {
@@ -98,37 +383,51 @@ size_t config_find_target(struct config *config, char *name)
 	return INVALID_INDEX;
 }
 
-int config_call_target(struct config *config, char *name)
+char *config_target_command(struct config *config, size_t index)
 {
-	size_t index, total_size;
+	struct target *target = config->targets[index];
+	size_t total_size, offset;
 	char *command, *curcmd;
 
 	total_size = 0;
-	index = config_find_target(config, name);
-	if (index == INVALID_INDEX)
-		return 1;
-
-	for (size_t i = 0; i < config->targets[index]->cmds.size; i++)
-		total_size += strlen(config->targets[index]->cmds.strs[i]) + 1;
+	for (size_t i = 0; i < target->cmds.size; i++)
+		total_size += strlen(target->cmds.strs[i]) + 1;
 
 	command = malloc(total_size + 1);
 	command[total_size] = 0;
 
 	/* Because we want to run the commands in a single system() call to get
 	   the set variables, we need to combine it all into a single string. */
-	size_t offset = 0;
-	for (size_t i = 0; i < config->targets[index]->cmds.size; i++) {
-		curcmd = config->targets[index]->cmds.strs[i];
+	offset = 0;
+	for (size_t i = 0; i < target->cmds.size; i++) {
+		curcmd = target->cmds.strs[i];
 		strncpy(command + offset, curcmd, total_size - offset);
 		offset += strlen(curcmd) + 1;
 		command[offset-1] = ';';
 	}
 
+	return command;
+}
+
+int config_call_target(struct config *config, char *name)
+{
+	struct proc_result res = {0};
+	size_t index;
+	char *command;
+
+	index = config_find_target(config, name);
+	if (index == INVALID_INDEX)
+		return 1;
+
+	command = config_target_command(config, index);
 	if (config->explain)
 		printf("issuing '%s\'", command);
 
-	/* RSD 10/4a: use at least system() for the shell command */
-	system(command);
+	/* RSD 10/4a: use at least system() for the shell command. We spawn
+	   /bin/sh ourselves, which keeps the same shell semantics. */
+	run_shell(command, &res);
 	free(command);
+
+	trace_span(name, "target", 0, res.start, res.start + res.wall);
 	return 0;
 }
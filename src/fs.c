@@ -4,41 +4,83 @@
  */
 
 #include "build.h"
+#include <fcntl.h>
+#include <errno.h>
+
+#if __linux__
+# include <sys/ioctl.h>
+# include <linux/fs.h>
+#endif
 
 
 void expand_wildcards(struct strlist *filenames)
 {
 	struct strlist expanded_filenames = {0};
-	char *dirp, *basep, *p_dirp, *p_basep;
-	size_t nfilenames;
+	struct globset exclude = {0};
+	struct walk_pattern *patterns;
+	char *dirp, *basep, *dir, *path;
+	size_t npatterns, p;
 
-	nfilenames = filenames->size;
-	for (size_t i = 0; i < nfilenames; i++) {
-		if (!strchr(filenames->strs[i], '*'))
+	/* Collect all wildcards first, so the tree is only walked once. The
+	   excluded directories are not walked at all. */
+
+	patterns = calloc(filenames->size, sizeof(*patterns));
+	npatterns = 0;
+	for (size_t i = 0; i < filenames->size; i++) {
+		path = filenames->strs[i];
+		if (path[0] == '!') {
+			if (path[1])
+				globset_add(&exclude, path + 1);
 			continue;
+		}
 
-		/* As per the manpage, the wildcard path needs to be split into the
-		   `dirname` and `basename` for `find`. */
-		dirp    = strdup(filenames->strs[i]);
-		basep   = strdup(filenames->strs[i]);
-		p_dirp  = dirname(dirp);
-		p_basep = basename(basep);
+		if (!is_glob(path))
+			continue;
 
-		find(&expanded_filenames, 'f', p_dirp, p_basep);
+		/* As per the manpage, a wildcard only in the basename is matched
+		   in any directory below the dirname, like `find -name`. Anything
+		   else is matched against the whole path. */
+		dirp  = strdup(path);
+		basep = strdup(path);
+		dir = dirname(dirp);
+		if (strstr(path, "**") || is_glob(dir)) {
+			patterns[npatterns].glob = malloc(sizeof(struct glob));
+			glob_compile(patterns[npatterns].glob, path);
+			patterns[npatterns].dir = glob_root(patterns[npatterns].glob);
+		} else {
+			patterns[npatterns].dir = strdup(dir);
+			patterns[npatterns].name = strdup(basename(basep));
+		}
+		npatterns++;
 		free(dirp);
 		free(basep);
+	}
 
-		if (!expanded_filenames.size)
-			continue;
+	if (!npatterns) {
+		globset_free(&exclude);
+		free(patterns);
+		return;
+	}
 
-		/* Replace the wildcard string with the first found file. */
-		free(filenames->strs[i]);
-		filenames->strs[i] = strdup(expanded_filenames.strs[0]);
-		for (size_t j = 1; j < expanded_filenames.size; j++)
-			strlist_append(filenames, expanded_filenames.strs[j]);
+	walk(patterns, npatterns, &exclude);
+	globset_free(&exclude);
 
-		strlist_free(&expanded_filenames);
+	/* Replace each wildcard with the files it found, in place. */
+	p = 0;
+	for (size_t i = 0; i < filenames->size; i++) {
+		if (filenames->strs[i][0] == '!' || !is_glob(filenames->strs[i])) {
+			strlist_append(&expanded_filenames, filenames->strs[i]);
+			continue;
+		}
+
+		for (size_t j = 0; j < patterns[p].results.size; j++)
+			strlist_append(&expanded_filenames, patterns[p].results.strs[j]);
+		walk_pattern_free(&patterns[p++]);
 	}
+
+	strlist_free(filenames);
+	*filenames = expanded_filenames;
+	free(patterns);
 }
 
 void resolve_buildpath(struct config *config)
@@ -59,81 +101,44 @@ void resolve_buildpath(struct config *config)
 void remove_excluded(struct strlist *filenames)
 {
 	struct strlist new_list = {0};
-	struct strlist exclude_list = {0};
-	size_t size;
+	struct globset exclude = {0};
 
-	/* Collect the excluded filenames. */
+	/* Compile the excludes once, instead of comparing every file with
+	   every one of them. */
 
 	for (size_t i = 0; i < filenames->size; i++) {
-		if (filenames->strs[i][0] == '!') {
-			if (filenames->strs[i][1] == 0)
-				continue;
-			strlist_append(&exclude_list, filenames->strs[i] + 1);
-
-			free(filenames->strs[i]);
-			filenames->strs[i] = NULL;
-		}
+		if (filenames->strs[i][0] == '!' && filenames->strs[i][1])
+			globset_add(&exclude, filenames->strs[i] + 1);
 	}
 
 	for (size_t i = 0; i < filenames->size; i++) {
-		if (!filenames->strs[i])
+		if (filenames->strs[i][0] == '!')
 			continue;
-
-		bool exclude_this_file = false;
-		for (size_t j = 0; j < exclude_list.size; j++) {
-			size = strlen(exclude_list.strs[j]);
-			if (exclude_list.strs[j][size - 1] != '/')
-				continue;
-
-			if (strncmp(filenames->strs[i], exclude_list.strs[j], size) == 0) {
-				exclude_this_file = true;
-				break;
-			}
-		}
-
-		if (strlist_find(&exclude_list, filenames->strs[i]) != INVALID_INDEX)
-			exclude_this_file = true;
-
-		if (!exclude_this_file)
+		if (!globset_match(&exclude, filenames->strs[i]))
 			strlist_append(&new_list, filenames->strs[i]);
 	}
 
 	/* Move the new_list into the filenames list. */
 
-	strlist_free(&exclude_list);
+	globset_free(&exclude);
 	strlist_free(filenames);
-	filenames->size = new_list.size;
-	filenames->strs = new_list.strs;
+	*filenames = new_list;
 }
 
-int find(struct strlist *output, char type, char *dir, char *name)
+int find(struct strlist *output, char *dir, char *name)
 {
-	int added_amount = 0;
-	char path[PATH_MAX];
-	FILE *res;
+	struct walk_pattern pattern = {0};
+	int added_amount;
 
-	snprintf(path, PATH_MAX, "find %s -type %c -name '%s'", dir, type, name);
+	pattern.dir = strdup(dir);
+	pattern.name = strdup(name);
+	walk(&pattern, 1, NULL);
 
-	res = popen(path, "r");
-	if (!res) {
-		perror("build: failed to popen");
-		exit(EXIT_POPEN);
-	}
-
-	while (fgets(path, PATH_MAX, res)) {
-		for (size_t i = 0; i < PATH_MAX; i++) {
-			if (path[i] == '\n') {
-				path[i] = 0;
-				break;
-			}
-		}
+	for (size_t i = 0; i < pattern.results.size; i++)
+		strlist_append(output, pattern.results.strs[i]);
 
-		/* Remove ./ from path */
-		strlist_append(output, path + (*dir == '.' ? 2 : 0));
-		added_amount++;
-	}
-
-	pclose(res);
+	added_amount = pattern.results.size;
+	walk_pattern_free(&pattern);
 	return added_amount;
 }
 
@@ -153,3 +158,92 @@ void removedir(char *path)
 {
 	nftw(path, unlink_callback, 64, FTW_DEPTH | FTW_PHYS);
 }
+
+int mkdir_p(char *path)
+{
+	char *copy, *p;
+	int ret;
+
+	copy = strdup(path);
+	for (p = copy + 1; *p; p++) {
+		if (*p != '/')
+			continue;
+		*p = 0;
+		mkdir(copy, 0775);
+		*p = '/';
+	}
+
+	ret = mkdir(copy, 0775) == -1 && errno != EEXIST;
+	free(copy);
+	return ret;
+}
+
+int clone_file(char *from, char *to)
+{
+	/* A hardlink costs nothing, but only works on the same filesystem. */
+	if (!link(from, to))
+		return 0;
+
+	return copy_file(from, to);
+}
+
+int copy_file(char *from, char *to)
+{
+	char buf[LINESIZE * 4];
+	int in, out, ret;
+	ssize_t n;
+
+	in = open(from, O_RDONLY);
+	if (in == -1)
+		return 1;
+
+	out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+	if (out == -1) {
+		close(in);
+		return 1;
+	}
+
+	ret = 0;
+
+#ifdef FICLONE
+	/* Filesystems like btrfs & xfs can share the blocks of the file. */
+	if (!ioctl(out, FICLONE, in))
+		goto end;
+#endif
+
+	while ((n = read(in, buf, sizeof(buf))) > 0) {
+		if (write(out, buf, n) != n) {
+			ret = 1;
+			break;
+		}
+	}
+
+	if (n == -1)
+		ret = 1;
+
+#ifdef FICLONE
+end:
+#endif
+	close(in);
+	if (close(out) || ret) {
+		unlink(to);
+		return 1;
+	}
+
+	return 0;
+}
+
+void cat_file(char *path, FILE *out)
+{
+	char buf[LINESIZE];
+	size_t n;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return;
+
+	while ((n = fread(buf, 1, LINESIZE, f)))
+		fwrite(buf, 1, n, out);
+	fclose(f);
+}
@@ -0,0 +1,309 @@
+/*
+ * glob.c - compiled glob patterns
+ * Copyright (c) 2022 mini-rose
+ */
+
+#include "build.h"
+#include <fnmatch.h>
+
+
+/* A pattern is split into its path segments once, and each segment is
+   marked as a literal, a wildcard or "**", which matches any amount of
+   directories. Paths are then matched segment by segment, comparing the
+   literal ones with strcmp and only the wildcard ones with fnmatch, so
+   "*", "?" and "[a-z]" never match a "/".
+
+   A set of excludes puts the plain paths & directories into hash tables,
+   so most of them cost a single lookup no matter how many there are. The
+   remaining patterns are checked against the fixed text at their start &
+   end first, like the "src/" and "_test.c" of a pattern for the tests in
+   src, which rejects most paths without splitting them or calling
+   fnmatch. */
+
+#define SEG_LITERAL     'l'
+#define SEG_WILDCARD    'w'
+#define SEG_RECURSIVE   'r'
+
+/* Paths deeper than this are matched as if they were cut off. */
+#define GLOB_MAXDEPTH   256
+
+static size_t split_path(char *path, char **comps);
+static bool match_segs(struct glob *glob, size_t s, char **comps, size_t c,
+		size_t n);
+static bool match_fixed(struct glob *glob, const char *path);
+static const char *skip_dot(const char *path);
+
+
+bool is_glob(const char *str)
+{
+	return strpbrk(str, "*?[") != NULL;
+}
+
+void glob_compile(struct glob *glob, const char *pattern)
+{
+	char *copy, *seg, *saveptr, *last;
+	size_t len;
+
+	memset(glob, 0, sizeof(*glob));
+	copy = strdup(skip_dot(pattern));
+
+	len = strlen(copy);
+	if (len > 1 && copy[len - 1] == '/') {
+		copy[--len] = 0;
+		glob->dir = true;
+	}
+
+	/* Like in .gitignore, a pattern without a slash matches the name at
+	   any depth. */
+	glob->basename = !strchr(copy, '/');
+
+	for (seg = strtok_r(copy, "/", &saveptr); seg;
+			seg = strtok_r(NULL, "/", &saveptr)) {
+		/* Two "**" in a row are the same as one. */
+		if (!strcmp(seg, "**") && glob->segs.size
+				&& glob->kinds[glob->segs.size - 1] == SEG_RECURSIVE)
+			continue;
+
+		glob->kinds = realloc(glob->kinds, glob->segs.size + 1);
+		glob->kinds[glob->segs.size] = !strcmp(seg, "**") ? SEG_RECURSIVE
+			: is_glob(seg) ? SEG_WILDCARD : SEG_LITERAL;
+		strlist_append(&glob->segs, seg);
+	}
+
+	/* The fixed text before the first wildcard, and after the last one of
+	   the last segment. */
+	if (glob->segs.size) {
+		seg = (char *) skip_dot(pattern);
+		glob->head = strndup(seg, strcspn(seg, "*?["));
+
+		last = glob->segs.strs[glob->segs.size - 1];
+		seg = last + strlen(last);
+		while (seg > last && !strchr("*?[]", seg[-1]))
+			seg--;
+		glob->tail = strdup(seg);
+	}
+
+	free(copy);
+}
+
+bool glob_match(struct glob *glob, const char *path)
+{
+	char buf[PATH_MAX], *comps[GLOB_MAXDEPTH];
+	const char *name;
+	size_t n;
+
+	path = skip_dot(path);
+	if (!glob->segs.size || !match_fixed(glob, path))
+		return false;
+
+	if (glob->basename) {
+		name = strrchr(path, '/');
+		name = name ? name + 1 : path;
+		return match_segs(glob, 0, (char **) &name, 0, 1);
+	}
+
+	if (strlen(path) >= sizeof(buf))
+		return false;
+
+	strcpy(buf, path);
+	n = split_path(buf, comps);
+	return match_segs(glob, 0, comps, 0, n);
+}
+
+bool glob_match_below(struct glob *glob, const char *dir)
+{
+	char buf[PATH_MAX], *comps[GLOB_MAXDEPTH];
+	size_t s = 0, n;
+
+	dir = skip_dot(dir);
+	if (glob->basename || !strcmp(dir, "."))
+		return true;
+	if (strlen(dir) >= sizeof(buf))
+		return true;
+
+	/* Every directory has to match a segment, until a "**" takes the
+	   rest, and one segment has to be left for the file itself. */
+	strcpy(buf, dir);
+	n = split_path(buf, comps);
+	for (size_t c = 0; c < n; c++, s++) {
+		if (s == glob->segs.size)
+			return false;
+		if (glob->kinds[s] == SEG_RECURSIVE)
+			return true;
+		if (glob->kinds[s] == SEG_LITERAL ? strcmp(glob->segs.strs[s],
+					comps[c]) : fnmatch(glob->segs.strs[s], comps[c], 0))
+			return false;
+	}
+
+	return s < glob->segs.size;
+}
+
+char *glob_root(struct glob *glob)
+{
+	struct strlist dirs = {0};
+	char *root;
+
+	/* The literal directories before the first wildcard. */
+	for (size_t s = 0; !glob->basename && s + 1 < glob->segs.size
+			&& glob->kinds[s] == SEG_LITERAL; s++)
+		strlist_append(&dirs, glob->segs.strs[s]);
+
+	root = dirs.size ? strlist_join(&dirs, "/") : strdup(".");
+	strlist_free(&dirs);
+	return root;
+}
+
+void glob_free(struct glob *glob)
+{
+	strlist_free(&glob->segs);
+	free(glob->kinds);
+	free(glob->head);
+	free(glob->tail);
+	memset(glob, 0, sizeof(*glob));
+}
+
+void globset_add(struct globset *set, const char *pattern)
+{
+	char *path;
+	size_t len;
+
+	pattern = skip_dot(pattern);
+	if (is_glob(pattern)) {
+		set->globs = realloc(set->globs, sizeof(*set->globs)
+				* (set->nglobs + 1));
+		glob_compile(&set->globs[set->nglobs++], pattern);
+		return;
+	}
+
+	/* A trailing slash means everything in the directory. */
+	path = strdup(pattern);
+	len = strlen(path);
+	if (len > 1 && path[len - 1] == '/') {
+		path[len - 1] = 0;
+		strmap_set(&set->dirs, path, 1);
+	} else {
+		strmap_set(&set->paths, path, 1);
+	}
+
+	free(path);
+}
+
+bool globset_match(struct globset *set, const char *path)
+{
+	char buf[PATH_MAX], *slash;
+	uint64_t val;
+
+	path = skip_dot(path);
+	if (strmap_get(&set->paths, path, &val))
+		return true;
+
+	for (size_t i = 0; i < set->nglobs; i++) {
+		if (!set->globs[i].dir && glob_match(&set->globs[i], path))
+			return true;
+	}
+
+	if (strlen(path) >= sizeof(buf))
+		return false;
+
+	/* Then each directory the path is in. */
+	strcpy(buf, path);
+	while ((slash = strrchr(buf, '/'))) {
+		*slash = 0;
+		if (globset_match_dir(set, buf))
+			return true;
+	}
+
+	return false;
+}
+
+bool globset_match_dir(struct globset *set, const char *dir)
+{
+	uint64_t val;
+
+	dir = skip_dot(dir);
+	if (strmap_get(&set->dirs, dir, &val))
+		return true;
+
+	for (size_t i = 0; i < set->nglobs; i++) {
+		if (set->globs[i].dir && glob_match(&set->globs[i], dir))
+			return true;
+	}
+
+	return false;
+}
+
+void globset_free(struct globset *set)
+{
+	strmap_free(&set->paths);
+	strmap_free(&set->dirs);
+	for (size_t i = 0; i < set->nglobs; i++)
+		glob_free(&set->globs[i]);
+	free(set->globs);
+	memset(set, 0, sizeof(*set));
+}
+
+static size_t split_path(char *path, char **comps)
+{
+	char *saveptr, *comp;
+	size_t n = 0;
+
+	for (comp = strtok_r(path, "/", &saveptr); comp && n < GLOB_MAXDEPTH;
+			comp = strtok_r(NULL, "/", &saveptr))
+		comps[n++] = comp;
+	return n;
+}
+
+static bool match_segs(struct glob *glob, size_t s, char **comps, size_t c,
+		size_t n)
+{
+	for (; s < glob->segs.size; s++, c++) {
+		/* Try to continue after every amount of directories. */
+		if (glob->kinds[s] == SEG_RECURSIVE) {
+			if (s + 1 == glob->segs.size)
+				return c < n;
+			for (size_t k = c; k < n; k++) {
+				if (match_segs(glob, s + 1, comps, k, n))
+					return true;
+			}
+			return false;
+		}
+
+		if (c == n)
+			return false;
+
+		if (glob->kinds[s] == SEG_LITERAL) {
+			if (strcmp(glob->segs.strs[s], comps[c]))
+				return false;
+		} else if (fnmatch(glob->segs.strs[s], comps[c], 0)) {
+			return false;
+		}
+	}
+
+	return c == n;
+}
+
+static bool match_fixed(struct glob *glob, const char *path)
+{
+	size_t len = strlen(path), tlen;
+	const char *name;
+
+	if (!glob->tail)
+		return true;
+
+	tlen = strlen(glob->tail);
+	if (len < tlen || strcmp(path + len - tlen, glob->tail))
+		return false;
+
+	/* A pattern without a slash starts at the name. */
+	name = glob->basename ? strrchr(path, '/') : NULL;
+	name = name ? name + 1 : path;
+
+	return !strncmp(name, glob->head, strlen(glob->head));
+}
+
+static const char *skip_dot(const char *path)
+{
+	while (path[0] == '.' && path[1] == '/')
+		path += 2;
+	return *path ? path : ".";
+}
@@ -0,0 +1,113 @@
+/*
+ * hash.c - fast non-cryptographic hashing
+ * Copyright (c) 2022 mini-rose
+ */
+
+#include "build.h"
+#include <fcntl.h>
+
+
+/* 64-bit FNV-1a, see <http://www.isthe.com/chongo/tech/comp/fnv/>. */
+#define FNV_PRIME       0x100000001b3ULL
+
+
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= FNV_PRIME;
+	}
+
+	return hash;
+}
+
+uint64_t hash_str(uint64_t hash, const char *str)
+{
+	/* Include the null byte, so "ab" "c" and "a" "bc" hash differently. */
+	return hash_bytes(hash, str, strlen(str) + 1);
+}
+
+int hash_file(uint64_t *hash, const char *path)
+{
+	char buf[LINESIZE * 4];
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return 1;
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		*hash = hash_bytes(*hash, buf, n);
+
+	close(fd);
+	return n == -1;
+}
+
+bool strmap_get(struct strmap *map, const char *key, uint64_t *val)
+{
+	size_t index;
+
+	if (!map->size)
+		return false;
+
+	index = hash_str(HASH_INIT, key) & (map->size - 1);
+	while (map->slots[index].key) {
+		if (!strcmp(map->slots[index].key, key)) {
+			*val = map->slots[index].val;
+			return true;
+		}
+		index = (index + 1) & (map->size - 1);
+	}
+
+	return false;
+}
+
+void strmap_set(struct strmap *map, const char *key, uint64_t val)
+{
+	struct strmap_entry *old_slots;
+	size_t old_size, index;
+
+	/* Keep the table at most half full. */
+	if (map->used * 2 >= map->size) {
+		old_slots = map->slots;
+		old_size = map->size;
+		map->size = old_size ? old_size * 2 : 256;
+		map->slots = calloc(map->size, sizeof(*old_slots));
+
+		for (size_t i = 0; i < old_size; i++) {
+			if (!old_slots[i].key)
+				continue;
+			index = hash_str(HASH_INIT, old_slots[i].key) & (map->size - 1);
+			while (map->slots[index].key)
+				index = (index + 1) & (map->size - 1);
+			map->slots[index] = old_slots[i];
+		}
+
+		free(old_slots);
+	}
+
+	index = hash_str(HASH_INIT, key) & (map->size - 1);
+	while (map->slots[index].key) {
+		if (!strcmp(map->slots[index].key, key)) {
+			map->slots[index].val = val;
+			return;
+		}
+		index = (index + 1) & (map->size - 1);
+	}
+
+	map->slots[index].key = strdup(key);
+	map->slots[index].val = val;
+	map->used++;
+}
+
+void strmap_free(struct strmap *map)
+{
+	for (size_t i = 0; i < map->size; i++)
+		free(map->slots[i].key);
+	free(map->slots);
+
+	memset(map, 0, sizeof(*map));
+}
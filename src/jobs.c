@@ -0,0 +1,246 @@
+/*
+ * jobs.c - running commands in parallel
+ * Copyright (c) 2022 mini-rose
+ */
+
+#include "build.h"
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+
+
+/* How long to wait before asking queue->admit() again, in ms. */
+#define ADMIT_RETRY     250
+
+/* Instead of a thread per job slot, which would sit blocked in system(), we
+   run all children from a single loop. SIGCHLD writes into a pipe, so the
+   loop can sleep in poll() until any child exits, and immediately hand the
+   next job from the queue to the free slot.
+
+   The last queue->nremote slots run jobs on other machines. Their process
+   here mostly waits, so they don't need a jobserver token, and are not
+   limited by queue->admit(). */
+
+static int sigchld_pipe[2] = {-1, -1};
+
+/* A job may run a queue of its own, like the compile step of the targets.
+   The local jobs still running in the queues further up keep their slots,
+   and the wakeups for their children may be read by the inner loop, so it
+   leaves one behind when it returns. */
+static int local_jobs;
+static int nesting;
+
+static size_t next_job(struct jobqueue *queue, bool *started, size_t *first);
+static void sigchld_handler(int sig);
+static void setup_sigchld(void);
+
+
+int jobs_run(struct jobqueue *queue)
+{
+	struct proc_result *procs;
+	struct pollfd pfds[2];
+	size_t *slot_jobs, *running_jobs, next, first;
+	int running, local, held, npfds, nrunning, nlocal, outer;
+	bool waiting, throttled, remote, *started;
+	char buf[64];
+
+	setup_sigchld();
+
+	procs = calloc(queue->nslots, sizeof(*procs));
+	slot_jobs = calloc(queue->nslots, sizeof(*slot_jobs));
+	running_jobs = calloc(queue->nslots, sizeof(*running_jobs));
+	started = calloc(queue->njobs, sizeof(*started));
+	queue->failed = 0;
+	nlocal = queue->nslots - queue->nremote;
+	outer = local_jobs;
+	nesting++;
+	running = 0;
+	local = 0;
+	held = 0;
+	first = 0;
+
+	while (first < queue->njobs || running) {
+		/* Fill all free slots. Jobs that finish without a process, like
+		   cache hits, don't take up the slot. The first running job uses
+		   our own job slot, every other one needs a jobserver token. In a
+		   nested queue, that is the slot of the job running it, and the
+		   other jobs further up keep theirs. */
+		waiting = throttled = false;
+		for (int slot = 0; slot < queue->nslots;) {
+			if (procs[slot].pid) {
+				slot++;
+				continue;
+			}
+			if (slot && slot < nlocal && slot >= nlocal - outer) {
+				slot = nlocal;
+				continue;
+			}
+
+			next = next_job(queue, started, &first);
+			if (next == INVALID_INDEX)
+				break;
+
+			/* When no local slot can be used, try the remote ones. */
+			remote = slot >= nlocal;
+			if (!remote && local && queue->admit) {
+				nrunning = 0;
+				for (int i = 0; i < nlocal; i++) {
+					if (procs[i].pid)
+						running_jobs[nrunning++] = slot_jobs[i];
+				}
+
+				if (!queue->admit(queue, next, running_jobs, nrunning)) {
+					throttled = true;
+					if (nlocal == queue->nslots)
+						break;
+					slot = nlocal;
+					continue;
+				}
+			}
+
+			if (!remote && local) {
+				if (!jobserver_acquire()) {
+					waiting = true;
+					if (nlocal == queue->nslots)
+						break;
+					slot = nlocal;
+					continue;
+				}
+				held++;
+			}
+
+			started[next] = true;
+			procs[slot].slot = slot;
+			procs[slot].start = clock_now();
+			procs[slot].pid = queue->start(queue, next, slot);
+			if (procs[slot].pid > 0) {
+				slot_jobs[slot] = next;
+				running++;
+				if (!remote) {
+					local++;
+					local_jobs++;
+				}
+				slot++;
+			} else {
+				if (procs[slot].pid == -1)
+					queue->failed++;
+				procs[slot].pid = 0;
+				if (!remote && local) {
+					jobserver_release();
+					held--;
+				}
+			}
+		}
+
+		/* Nothing is running, and nothing can be started anymore. */
+		if (!running) {
+			if (next_job(queue, started, &first) == INVALID_INDEX)
+				break;
+			continue;
+		}
+
+		pfds[0] = (struct pollfd) { .fd = sigchld_pipe[0], .events = POLLIN };
+		pfds[1] = (struct pollfd) { .fd = jobserver_fd(), .events = POLLIN };
+		npfds = waiting && jobserver_fd() != -1 ? 2 : 1;
+
+		if (poll(pfds, npfds, throttled ? ADMIT_RETRY : -1) == -1
+				&& errno != EINTR)
+			break;
+		while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0)
+			;
+
+		/* Only wait for our own children, so a pclose() somewhere else
+		   doesn't lose its child. */
+		for (int slot = 0; slot < queue->nslots; slot++) {
+			if (!procs[slot].pid || !proc_wait(procs[slot].pid, false,
+						&procs[slot]))
+				continue;
+
+			procs[slot].pid = 0;
+			running--;
+
+			/* Which job used our own slot doesn't matter, as long as we
+			   hold one token less than the local jobs we run. */
+			if (slot < nlocal) {
+				local--;
+				local_jobs--;
+				if (held) {
+					jobserver_release();
+					held--;
+				}
+			}
+
+			if (procs[slot].status)
+				queue->failed++;
+			queue->finish(queue, slot_jobs[slot], &procs[slot]);
+		}
+	}
+
+	if (--nesting)
+		write(sigchld_pipe[1], "", 1);
+
+	free(started);
+	free(running_jobs);
+	free(slot_jobs);
+	free(procs);
+	return queue->failed;
+}
+
+static size_t next_job(struct jobqueue *queue, bool *started, size_t *first)
+{
+	int ready;
+
+	while (*first < queue->njobs && started[*first])
+		(*first)++;
+
+	/* Take the first job in order, which is ready. The ones which can never
+	   run are skipped for good. */
+	for (size_t job = *first; job < queue->njobs; job++) {
+		if (started[job])
+			continue;
+
+		ready = queue->ready ? queue->ready(queue, job) : 1;
+		if (ready > 0)
+			return job;
+		if (ready < 0)
+			started[job] = true;
+	}
+
+	while (*first < queue->njobs && started[*first])
+		(*first)++;
+
+	return INVALID_INDEX;
+}
+
+static void sigchld_handler(int sig)
+{
+	int saved_errno = errno;
+
+	(void) sig;
+	write(sigchld_pipe[1], "", 1);
+	errno = saved_errno;
+}
+
+static void setup_sigchld(void)
+{
+	struct sigaction sa = {0};
+
+	if (sigchld_pipe[0] != -1)
+		return;
+
+	if (pipe(sigchld_pipe) == -1) {
+		perror("build: failed to create a pipe");
+		exit(EXIT_THREAD);
+	}
+
+	for (int i = 0; i < 2; i++) {
+		fcntl(sigchld_pipe[i], F_SETFL, O_NONBLOCK);
+		fcntl(sigchld_pipe[i], F_SETFD, FD_CLOEXEC);
+	}
+
+	sa.sa_handler = sigchld_handler;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGCHLD, &sa, NULL);
+}
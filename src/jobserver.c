@@ -0,0 +1,255 @@
+/*
+ * jobserver.c - sharing job slots with make & other builds
+ * Copyright (c) 2022 mini-rose
+ */
+
+#include "build.h"
+#include <fcntl.h>
+#include <errno.h>
+
+
+/* The GNU make jobserver is a pipe (or a named fifo) holding one byte for
+   every job slot but the first. Each process gets the first slot for free,
+   and has to read a token from the pipe before starting another job, and
+   write it back afterwards. The pipe is advertised to children in MAKEFLAGS,
+   so a build started by make, or by one of our targets, doesn't start more
+   jobs than the -j of the outermost process.
+
+   The pipe is blocking for the others, so we read it through a descriptor
+   of our own, which is non-blocking. A blocking read could wait for a token
+   forever, while our own children exit. */
+
+#define JOBSERVER_MAXTOKENS     4096
+
+static struct
+{
+	int readfd;                     /* our own, non-blocking */
+	int writefd;
+	char *tokens;                   /* the bytes we took, to give back */
+	size_t ntokens;
+} js = { .readfd = -1, .writefd = -1 };
+
+static bool join_jobserver(char *auth);
+static bool start_jobserver(int njobs);
+static bool make_fifo(int fds[2], int *readfd);
+static int reopen_nonblock(int fd);
+static bool valid_fd(int fd);
+
+
+int jobserver_init(struct config *config)
+{
+	char *makeflags, *word, *auth = NULL, *saveptr;
+	int njobs = 0;
+
+	/* Like make, an explicit -j means the user wants to decide the amount
+	   of jobs, so we don't join a parent jobserver. */
+
+	makeflags = getenv("MAKEFLAGS");
+	if (makeflags && !config->use_n_threads) {
+		makeflags = strdup(makeflags);
+		for (word = strtok_r(makeflags, " \t", &saveptr); word;
+				word = strtok_r(NULL, " \t", &saveptr)) {
+			if (!strncmp(word, "--jobserver-auth=", 17))
+				auth = word + 17;
+			else if (!strncmp(word, "--jobserver-fds=", 16))
+				auth = word + 16;
+			else if (!strncmp(word, "-j", 2) && word[2])
+				njobs = atoi(word + 2);
+		}
+
+		if (auth && join_jobserver(auth)) {
+			if (config->explain)
+				printf("jobserver: joined %s\n", auth);
+			free(makeflags);
+
+			/* Without a descriptor of our own, only the free slot is used. */
+			if (js.readfd == -1)
+				return 1;
+			return njobs > 0 ? njobs : get_nprocs();
+		}
+
+		free(makeflags);
+	}
+
+	njobs = config->use_n_threads ? config->use_n_threads : get_nprocs();
+	if (njobs > 0 && start_jobserver(njobs) && config->explain)
+		printf("jobserver: started with %d jobs\n", njobs);
+
+	return njobs;
+}
+
+bool jobserver_acquire(void)
+{
+	char token;
+	ssize_t n;
+
+	if (js.writefd == -1)
+		return true;
+	if (js.readfd == -1)
+		return false;
+
+	/* EAGAIN means another process took the last token, so we wait for the
+	   next one. */
+	do {
+		n = read(js.readfd, &token, 1);
+	} while (n == -1 && errno == EINTR);
+
+	if (n != 1)
+		return false;
+
+	if (js.ntokens < JOBSERVER_MAXTOKENS)
+		js.tokens[js.ntokens++] = token;
+	return true;
+}
+
+void jobserver_release(void)
+{
+	char token;
+
+	if (js.writefd == -1 || !js.ntokens)
+		return;
+
+	token = js.tokens[--js.ntokens];
+	while (write(js.writefd, &token, 1) == -1 && errno == EINTR)
+		;
+}
+
+int jobserver_fd(void)
+{
+	return js.readfd;
+}
+
+bool jobserver_enabled(void)
+{
+	return js.readfd != -1 && js.writefd != -1;
+}
+
+static bool join_jobserver(char *auth)
+{
+	int readfd, writefd;
+	char *end;
+
+	if (!strncmp(auth, "fifo:", 5)) {
+		readfd = open(auth + 5, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		if (readfd == -1) {
+			fprintf(stderr, "build: cannot open jobserver %s\n", auth + 5);
+			return false;
+		}
+
+		js.readfd = js.writefd = readfd;
+	} else {
+		readfd = strtol(auth, &end, 10);
+		if (*end != ',')
+			return false;
+		writefd = strtol(end + 1, NULL, 10);
+
+		/* The parent didn't pass the pipe to us, for example because the
+		   rule wasn't marked as recursive with a "+". */
+		if (!valid_fd(readfd) || !valid_fd(writefd)) {
+			fputs("build: jobserver unavailable, using -j\n", stderr);
+			return false;
+		}
+
+		js.readfd = reopen_nonblock(readfd);
+		js.writefd = writefd;
+		if (js.readfd == -1)
+			fputs("build: cannot read the jobserver without blocking, "
+					"using one job\n", stderr);
+	}
+
+	js.tokens = malloc(JOBSERVER_MAXTOKENS);
+	return true;
+}
+
+static bool start_jobserver(int njobs)
+{
+	char buf[128], *makeflags;
+	int fds[2];
+	ssize_t n;
+
+	/* The pipe stays blocking & inheritable, as children expect it. Where
+	   it cannot be opened again, a fifo can. */
+	if (pipe(fds) == -1)
+		return false;
+
+	js.readfd = reopen_nonblock(fds[0]);
+	if (js.readfd == -1) {
+		close(fds[0]);
+		close(fds[1]);
+		if (!make_fifo(fds, &js.readfd))
+			return false;
+	}
+
+	js.tokens = malloc(JOBSERVER_MAXTOKENS);
+	memset(js.tokens, '+', JOBSERVER_MAXTOKENS);
+	for (int left = njobs - 1; left > 0;) {
+		n = write(fds[1], js.tokens, left < JOBSERVER_MAXTOKENS ? left
+				: JOBSERVER_MAXTOKENS);
+		if (n <= 0)
+			break;
+		left -= n;
+	}
+
+	js.writefd = fds[1];
+
+	/* Keep the flags of a make above us, it only had no jobserver. */
+	makeflags = getenv("MAKEFLAGS");
+	snprintf(buf, sizeof(buf), "-j%d --jobserver-auth=%d,%d", njobs,
+			fds[0], fds[1]);
+	if (makeflags && *makeflags) {
+		makeflags = strdup(makeflags);
+		makeflags = realloc(makeflags, strlen(makeflags) + strlen(buf) + 2);
+		strcat(makeflags, " ");
+		strcat(makeflags, buf);
+		setenv("MAKEFLAGS", makeflags, 1);
+		free(makeflags);
+	} else {
+		setenv("MAKEFLAGS", buf, 1);
+	}
+
+	return true;
+}
+
+static bool make_fifo(int fds[2], int *readfd)
+{
+	char path[PATH_MAX];
+	char *tmpdir;
+	int fd;
+
+	tmpdir = getenv("TMPDIR");
+	snprintf(path, sizeof(path), "%s/build-jobserver.%d",
+			tmpdir && *tmpdir ? tmpdir : "/tmp", (int) getpid());
+	if (mkfifo(path, 0600) == -1)
+		return false;
+
+	/* The children get a blocking descriptor for both ends, we read from
+	   our own one. Once both are open, the name is not needed anymore. */
+	fd = open(path, O_RDWR);
+	*readfd = fd != -1 ? open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC) : -1;
+	unlink(path);
+
+	if (*readfd == -1) {
+		if (fd != -1)
+			close(fd);
+		return false;
+	}
+
+	fds[0] = fds[1] = fd;
+	return true;
+}
+
+static int reopen_nonblock(int fd)
+{
+	char path[64];
+
+	/* Setting O_NONBLOCK on the pipe would change it for every process
+	   sharing it, but opening it again through /proc gives us our own open
+	   file description. */
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	return open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+}
+
+static bool valid_fd(int fd)
+{
+	return fd >= 0 && fcntl(fd, F_GETFD) != -1;
+}
@@ -0,0 +1,195 @@
+/*
+ * limits.c - admission control for starting jobs
+ * Copyright (c) 2022 mini-rose
+ */
+
+/* getloadavg() is not part of POSIX. */
+#define _DEFAULT_SOURCE
+#define _DARWIN_C_SOURCE
+
+#include "build.h"
+
+
+/* Before starting another job next to the running ones, check that the
+   machine can take it: the load average & memory pressure are below the
+   limits, and the peak memory recorded for the job fits into the memory
+   which is still available, minus what the running jobs are expected to
+   take on top of what they already use. Only the first job is always
+   started, so the build cannot get stuck. */
+
+static char *cgroup_dir;
+
+static long read_meminfo(const char *key);
+static long long read_cgroup_value(const char *file);
+static double read_pressure(void);
+static long proc_rss(pid_t pid);
+
+
+void limits_init(struct config *config)
+{
+	char buf[LINESIZE];
+	FILE *f;
+
+	if (config->maxload_str)
+		config->limits.load = strtod(config->maxload_str, NULL);
+	if (config->maxmem_str)
+		config->limits.mem = parse_size(config->maxmem_str);
+	if (config->maxpressure_str)
+		config->limits.pressure = strtod(config->maxpressure_str, NULL);
+
+	/* With cgroup v2, the limit of our cgroup is what matters, not the
+	   memory of the whole machine. The line looks like "0::/user.slice". */
+	if (cgroup_dir || !(f = fopen("/proc/self/cgroup", "r")))
+		return;
+
+	while (fgets(buf, LINESIZE, f)) {
+		buf[linelen(buf)] = 0;
+		if (strncmp(buf, "0::", 3))
+			continue;
+
+		cgroup_dir = malloc(strlen(buf) + 16);
+		sprintf(cgroup_dir, "/sys/fs/cgroup%s", buf + 3);
+		break;
+	}
+
+	fclose(f);
+}
+
+bool limits_admit(struct config *config, long rss, pid_t *running,
+		long *running_rss, int nrunning)
+{
+	struct limits *limits = &config->limits;
+	long long available, max, current;
+	long outstanding = 0, committed = 0, used;
+	double load;
+
+	if (!nrunning)
+		return true;
+
+	if (limits->load > 0 && getloadavg(&load, 1) == 1
+			&& load >= limits->load) {
+		return false;
+	}
+
+	if (limits->pressure > 0 && read_pressure() >= limits->pressure)
+		return false;
+
+	/* Peak memory of the running jobs, which they haven't reached yet. */
+	for (int i = 0; i < nrunning; i++) {
+		committed += running_rss[i];
+		used = proc_rss(running[i]);
+		if (used >= 0 && used < running_rss[i])
+			outstanding += running_rss[i] - used;
+		else if (used < 0)
+			outstanding += running_rss[i];
+	}
+
+	if (limits->mem > 0 && (committed + rss) * 1024LL > limits->mem)
+		return false;
+
+	if (rss <= 0)
+		return true;
+
+	available = read_meminfo("MemAvailable:");
+	max = read_cgroup_value("memory.max");
+	current = read_cgroup_value("memory.current");
+	if (max > 0 && current >= 0 && (available < 0
+				|| (max - current) / 1024 < available)) {
+		available = (max - current) / 1024;
+	}
+
+	return available < 0 || rss + outstanding <= available;
+}
+
+void limits_free(void)
+{
+	free(cgroup_dir);
+	cgroup_dir = NULL;
+}
+
+static long read_meminfo(const char *key)
+{
+	char buf[LINESIZE];
+	long val = -1;
+	FILE *f;
+
+	f = fopen("/proc/meminfo", "r");
+	if (!f)
+		return -1;
+
+	while (fgets(buf, LINESIZE, f)) {
+		if (!strncmp(buf, key, strlen(key))) {
+			val = strtol(buf + strlen(key), NULL, 10);
+			break;
+		}
+	}
+
+	fclose(f);
+	return val;
+}
+
+static long long read_cgroup_value(const char *file)
+{
+	char path[PATH_MAX], buf[64];
+	long long val = -1;
+	FILE *f;
+
+	if (!cgroup_dir)
+		return -1;
+
+	/* memory.max is "max" without a limit, which gives -1 too. */
+	snprintf(path, sizeof(path), "%s/%s", cgroup_dir, file);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	if (fgets(buf, sizeof(buf), f) && *buf >= '0' && *buf <= '9')
+		val = strtoll(buf, NULL, 10);
+
+	fclose(f);
+	return val;
+}
+
+static double read_pressure(void)
+{
+	char path[PATH_MAX], buf[LINESIZE], *p;
+	double val = 0;
+	FILE *f = NULL;
+
+	/* The line is "some avg10=1.23 avg60=0.50 avg300=0.10 total=1234". */
+	if (cgroup_dir) {
+		snprintf(path, sizeof(path), "%s/memory.pressure", cgroup_dir);
+		f = fopen(path, "r");
+	}
+
+	if (!f && !(f = fopen("/proc/pressure/memory", "r")))
+		return 0;
+
+	while (fgets(buf, LINESIZE, f)) {
+		if (strncmp(buf, "some ", 5) || !(p = strstr(buf, "avg10=")))
+			continue;
+		val = strtod(p + 6, NULL);
+		break;
+	}
+
+	fclose(f);
+	return val;
+}
+
+static long proc_rss(pid_t pid)
+{
+	char path[64];
+	long pages;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/statm", (int) pid);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	if (fscanf(f, "%*s %ld", &pages) != 1)
+		pages = -1;
+
+	fclose(f);
+	return pages < 0 ? -1 : pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
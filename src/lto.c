@@ -0,0 +1,143 @@
+/*
+ * lto.c - link time optimization
+ * Copyright (c) 2022 mini-rose
+ */
+
+#include "build.h"
+
+
+/* With the lto option, the objects hold the intermediate code of the
+   compiler, and the code is generated when linking, for the whole program
+   at once. The link then does most of the work, so it gets as many jobs as
+   -j, as it usually runs when nothing else is left to compile.
+
+   clang has ThinLTO, which generates the code of each module separately,
+   in parallel, and keeps it in a cache in the build directory. A relink
+   after a small change only generates the code of the modules it affected.
+   Full LTO generates all code in a single job.
+
+   gcc has no ThinLTO, but splits the program into partitions which are
+   generated in parallel, which is what thin means for it. Full puts the
+   whole program into one partition. */
+
+#define LTO_CACHE   "lto-cache"
+
+static char *cache_dir(struct config *config);
+
+
+enum lto_mode lto_mode(struct config *config)
+{
+	const char *modes[] = {"off", "thin", "full"};
+
+	if (!config->lto)
+		return LTO_OFF;
+
+	for (size_t i = 0; i < sizeof(modes) / sizeof(*modes); i++) {
+		if (!strcmp(config->lto, modes[i]))
+			return (enum lto_mode) i;
+	}
+
+	return LTO_UNKNOWN;
+}
+
+bool lto_enabled(struct config *config)
+{
+	return lto_mode(config) > LTO_OFF && config->ccfamily != CC_OTHER;
+}
+
+void lto_prepare(struct config *config)
+{
+	enum lto_mode mode = lto_mode(config);
+	char *dir;
+
+	if (mode <= LTO_OFF)
+		return;
+
+	if (config->ccfamily == CC_OTHER) {
+		fprintf(stderr, "build: lto is only supported with gcc and clang, "
+				"ignoring it for %s\n", config->out);
+		return;
+	}
+
+	if (config->ccfamily == CC_GCC) {
+		strlist_append(&config->flags, "-flto");
+		if (mode == LTO_FULL)
+			strlist_append(&config->flags, "-flto-partition=one");
+		return;
+	}
+
+	strlist_append(&config->flags, mode == LTO_THIN ? "-flto=thin"
+			: "-flto=full");
+
+	if (mode == LTO_THIN) {
+		dir = cache_dir(config);
+		mkdir_p(dir);
+		free(dir);
+	}
+}
+
+void lto_link_flags(struct config *config, struct strlist *argv)
+{
+	char *dir;
+
+	if (!lto_enabled(config) || config->ccfamily != CC_CLANG
+			|| lto_mode(config) != LTO_THIN)
+		return;
+
+	/* ld64 has its own name for it, the others take the option of the
+	   LLVM linker plugin, which lld also knows. */
+	dir = cache_dir(config);
+#if __APPLE__
+	strlist_appendf(argv, "-Wl,-cache_path_lto,%s", dir);
+#else
+	strlist_appendf(argv, "-Wl,-plugin-opt=cache-dir=%s", dir);
+#endif
+	free(dir);
+}
+
+int lto_link_jobs(struct config *config, struct strlist *argv)
+{
+	int njobs = 1;
+
+	if (!lto_enabled(config) || (config->ccfamily != CC_GCC
+				&& lto_mode(config) != LTO_THIN))
+		return 0;
+
+	/* The last -flto=... of gcc wins over the -flto from the flags. gcc
+	   takes the tokens for its jobs from the jobserver itself. */
+	if (config->ccfamily == CC_GCC && jobserver_enabled()) {
+		strlist_append(argv, "-flto=jobserver");
+		return 0;
+	}
+
+	/* Otherwise the link gets the slots that are free right now, so it
+	   doesn't start -j jobs next to -j compilers. */
+	while (jobserver_enabled() && njobs < config->njobs
+			&& jobserver_acquire())
+		njobs++;
+
+	if (config->ccfamily == CC_GCC)
+		strlist_appendf(argv, "-flto=%d", njobs);
+	else
+		strlist_appendf(argv, "-flto-jobs=%d", njobs);
+	return njobs - 1;
+}
+
+char *lto_archiver(struct config *config)
+{
+	/* gcc-ar loads the plugin that reads the symbols of gcc LTO objects,
+	   which plain ar only does if it is installed for it. */
+	if (lto_enabled(config) && config->ccfamily == CC_GCC
+			&& !strcmp(config->ar, BUILD_AR))
+		return "gcc-ar";
+	return config->ar;
+}
+
+static char *cache_dir(struct config *config)
+{
+	char *dir;
+
+	dir = malloc(strlen(config->builddir) + strlen(LTO_CACHE) + 2);
+	sprintf(dir, "%s/" LTO_CACHE, config->builddir);
+	return dir;
+}
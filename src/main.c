@@ -9,7 +9,15 @@
 int main(int argc, char **argv)
 {
 	struct config config = {0};
-	int exit_status = 0;
+	int exit_status = 0, parsed, failed;
+	char *limits[3] = {NULL}, *worker = NULL, *name, *saveptr, flag;
+	double started;
+
+	/* A remote compile, started by ourselves. */
+	if (argc > 1 && !strcmp(argv[1], "--remote"))
+		return remote_main(argc - 2, argv + 2);
+
+	remote_init(argv[0]);
 	config.buildfile = strdup(BUILD_FILE);
 
 	argc--;
@@ -28,6 +36,19 @@ int main(int argc, char **argv)
 		if (!strcmp(argv[i], "--help"))
 			usage();
 
+		if (!strcmp(argv[i], "--stats") || !strcmp(argv[i], "--stats=table")
+				|| !strcmp(argv[i], "--stats=json")) {
+			stats_open(!strcmp(argv[i], "--stats=json"));
+			continue;
+		}
+
+		if (!strncmp(argv[i], "--stats=", 8)) {
+			fprintf(stderr, "build: unknown stats format %s, expected "
+					"table or json\n", argv[i] + 8);
+			exit_status = EXIT_ARG;
+			goto finish;
+		}
+
 		switch (argv[i][1]) {
 			case 'e':
 				config.explain = true;
@@ -47,6 +68,18 @@ int main(int argc, char **argv)
 			case 's':
 				config.only_setup = true;
 				break;
+			case 'l':
+			case 'm':
+			case 'p':
+				if (i + 1 >= argc) {
+					fprintf(stderr, "build: missing argument for -%c\n",
+							argv[i][1]);
+					exit_status = EXIT_ARG;
+					goto finish;
+				}
+				flag = argv[i][1];
+				limits[flag == 'l' ? 0 : flag == 'm' ? 1 : 2] = argv[++i];
+				break;
 			case 'j':
 				if (i + 1 >= argc) {
 					fputs("build: missing argument for -j\n", stderr);
@@ -55,6 +88,35 @@ int main(int argc, char **argv)
 				}
 				config.use_n_threads = atoi(argv[++i]);
 				break;
+			case 't':
+				if (i + 1 >= argc) {
+					fputs("build: missing argument for -t\n", stderr);
+					exit_status = EXIT_ARG;
+					goto finish;
+				}
+				trace_open(argv[++i]);
+				break;
+			case 'V':
+				if (i + 1 >= argc) {
+					fputs("build: missing argument for -V\n", stderr);
+					exit_status = EXIT_ARG;
+					goto finish;
+				}
+				for (name = strtok_r(argv[++i], ",", &saveptr); name;
+						name = strtok_r(NULL, ",", &saveptr))
+					strlist_append(&config.called_variants, name);
+				break;
+			case 'w':
+				config.watch = true;
+				break;
+			case 'W':
+				if (i + 1 >= argc) {
+					fputs("build: missing argument for -W\n", stderr);
+					exit_status = EXIT_ARG;
+					goto finish;
+				}
+				worker = argv[++i];
+				break;
 			case 'v':
 				printf("%d\n", BUILD_VERSION);
 				goto finish;
@@ -64,46 +126,77 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/* A worker needs no buildfile. */
+	if (worker) {
+		exit_status = worker_run(worker, config.use_n_threads,
+				&config.called_targets);
+		goto finish;
+	}
+
+	started = clock_now();
 	resolve_buildpath(&config);
+	trace_span("resolve_buildpath", "setup", 0, started, clock_now());
 
-	if (parse_buildfile(&config)) {
+	started = clock_now();
+	parsed = parse_buildfile(&config);
+	trace_span("parse_buildfile", "setup", 0, started, clock_now());
+
+	if (parsed) {
 		fprintf(stderr, "build: %s not found\n", config.buildfile);
 		exit_status = EXIT_BUILDFILE;
 		goto finish;
 	}
 
-	/* RSD 10/4d: run @before before anything else */
-	config_call_target(&config, "before");
+	/* The flags override the limits in the buildfile. */
+	if (limits[0]) {
+		free(config.maxload_str);
+		config.maxload_str = strdup(limits[0]);
+	}
+	if (limits[1]) {
+		free(config.maxmem_str);
+		config.maxmem_str = strdup(limits[1]);
+	}
+	if (limits[2]) {
+		free(config.maxpressure_str);
+		config.maxpressure_str = strdup(limits[2]);
+	}
 
-	if (config.called_targets.size) {
-		char *called;
-		for (size_t i = 0; i < config.called_targets.size; i++) {
-			called = config.called_targets.strs[i];
-			if (config_call_target(&config, called)) {
-				fprintf(stderr, "build: %s is not a target\n", called);
-				exit_status = EXIT_TARGET;
-				goto finish;
-			}
-		}
+	limits_init(&config);
 
-		/* Don't compile if a target is passed */
-		goto finish;
-	}
+	/* Everything we run from here on shares the same job slots. */
+	config.njobs = jobserver_init(&config);
+
+	/* RSD 10/4d: run @before before anything else */
+	config_call_target(&config, "before");
 
 	/* RSD 10/4c: If no targets have been specifically called, but the default
 	   target is defined in the buildfile, call that. Also as defined in the
-	   manpage, we do not compile if this is the case. */
-	if (!config_call_target(&config, "default"))
+	   manpage, we do not compile if this is the case, unless the target
+	   needs the compile step. */
+	if (!config.called_targets.size
+			&& config_find_target(&config, "default") != INVALID_INDEX)
+		strlist_append(&config.called_targets, "default");
+
+	if (config.called_targets.size) {
+		failed = targets_run(&config, &config.called_targets);
+		if (failed)
+			exit_status = failed == -1 ? EXIT_TARGET : EXIT_RUN;
 		goto finish;
+	}
 
-	if (!config.only_setup && config.sources.size)
-		compile(&config);
+	if (!config.only_setup && (config.sources.size || config.nartifacts)) {
+		if (config.watch ? watch(&config) : compile(&config))
+			exit_status = EXIT_COMPILE;
+	}
 
 finish:
 	/* RSD 10/4e: run after after everything has happend */
 	config_call_target(&config, "after");
+	trace_close();
+	stats_close();
 
 	config_free(&config);
+	limits_free();
 	return exit_status;
 }
 
@@ -111,14 +204,22 @@ void usage()
 {
 	/* RSD 3/3d: extended usage page format */
 	puts(
-		"usage: build [-cdfhsv] [target]\n"
+		"usage: build [-efhjlmpstvVwW] [target]\n"
 		"Minimal build tool\n\n"
 		"  -e           explain what is going on\n"
 		"  -f <file>    path to a different buildfile\n"
 		"  -h           show this page\n"
 		"  -s           only setup, do not start compiling\n"
-		"  -j <n>       compile on `n` threads (default: cpu count)\n"
-		"  -v           show the version number"
+		"  -j <n>       run `n` compilers at once (default: cpu count)\n"
+		"  -l <load>    don't start compilers above this load average\n"
+		"  -m <size>    memory the compilers may use together\n"
+		"  -p <pct>     don't start compilers above this memory pressure\n"
+		"  -t <file>    write a trace of the build to `file`\n"
+		"  -v           show the version number\n"
+		"  -V <names>   build these variants, separated by commas\n"
+		"  -w           build again whenever a file changes\n"
+		"  -W <addr> <cc...>  compile for other builds as a worker\n"
+		"  --stats[=json]  print the time of each phase & some counters"
 	);
 	exit(0);
 }
@@ -0,0 +1,212 @@
+/*
+ * pch.c - precompiled headers
+ * Copyright (c) 2022 mini-rose
+ */
+
+#include "build.h"
+#include <dirent.h>
+
+
+/* The header from the pch option is precompiled into the build directory,
+   into "pch/<hash>/", where the hash covers the compiler & flags, because
+   a precompiled header only works with the flags it was built with. Like
+   an object, it has a state file next to it, so it is only built again
+   when the header or any header it includes changes.
+
+   gcc finds "x.h.gch" when given "-include x.h", so we put a small x.h
+   including the real header next to it. If gcc rejects the precompiled
+   header, it falls back to that one. clang gets the file with -include-pch
+   instead.
+
+   Every output has its own build directory, so the other directories in
+   "pch/" are from older flags, compilers or headers, and are removed. */
+
+static void pch_command(struct config *config, char *header, char *output,
+		char *depfile, struct strlist *argv);
+static bool write_stub(char *path, char *header);
+static void remove_stale(char *dir, char *keep);
+
+
+void pch_prepare(struct config *config)
+{
+	struct strlist argv = {0};
+	struct objstate state, old;
+	struct proc_result res;
+	char *pchdir, *dir, *base, *header, *output, *depfile, *statepath, *cmd;
+	uint64_t hash;
+	int64_t since;
+	bool loaded;
+
+	if (!config->pch)
+		return;
+
+	if (config->ccfamily == CC_OTHER) {
+		fprintf(stderr, "build: pch is only supported with gcc and clang, "
+				"ignoring %s\n", config->pch);
+		return;
+	}
+
+	header = realpath(config->pch, NULL);
+	if (!header) {
+		fprintf(stderr, "build: cannot find the pch %s\n", config->pch);
+		return;
+	}
+
+	hash = hash_str(config->cchash, config->cc);
+	for (size_t i = 0; i < config->flags.size; i++)
+		hash = hash_str(hash, config->flags.strs[i]);
+	hash = hash_str(hash, header);
+
+	pchdir = malloc(strlen(config->builddir) + 8);
+	sprintf(pchdir, "%s/pch", config->builddir);
+	dir = malloc(strlen(pchdir) + 24);
+	sprintf(dir, "%s/%016llx", pchdir, (unsigned long long) hash);
+	mkdir_p(dir);
+	remove_stale(pchdir, dir + strlen(pchdir) + 1);
+
+	base = strrchr(header, '/') + 1;
+	output = malloc(strlen(dir) + strlen(base) + 8);
+	sprintf(output, "%s/%s.%s", dir, base,
+			config->ccfamily == CC_GCC ? "gch" : "pch");
+	statepath = malloc(strlen(output) + 8);
+	sprintf(statepath, "%s.state", output);
+	depfile = malloc(strlen(output) + 8);
+	sprintf(depfile, "%s.d", output);
+
+	pch_command(config, header, output, depfile, &argv);
+	cmd = strlist_join(&argv, " ");
+
+	loaded = !objstate_load(&old, statepath);
+	if (!loaded || objstate_dirty(&old, hash_str(HASH_INIT, cmd),
+				config->cchash) || file_mtime(output) == -1) {
+		printf("\033[2K\rPrecompiling %s...", config->pch);
+		fflush(stdout);
+		if (config->explain)
+			printf("issuing: '%s'\n", cmd);
+
+		/* The inputs are stat'ed before compiling, so a change while it
+		   runs is noticed by the next build. */
+		unlink(statepath);
+		state = (struct objstate) {
+			.cmdhash = hash_str(HASH_INIT, cmd),
+			.cchash = config->cchash
+		};
+		objstate_add_input(&state, header);
+		since = file_clock();
+
+		run_cmd(&argv, needs_shell(config), &res);
+		trace_span(config->pch, "pch", 0, res.start, res.start + res.wall);
+
+		if (res.status) {
+			fprintf(stderr, "\nbuild: precompiling %s failed, compiling "
+					"without it\n", config->pch);
+			objstate_free(&state);
+			goto end;
+		}
+
+		state.time = res.wall;
+		state.rss = res.maxrss;
+		objstate_read_depfile(&state, depfile, since);
+		objstate_save(&state, statepath);
+		objstate_free(&old);
+		old = state;
+	} else if (config->explain) {
+		printf("up to date: %s\n", output);
+	}
+
+	/* Every object depends on the headers of the pch too, so they get into
+	   the object states & cache manifests. */
+	for (size_t i = 0; i < old.inputs.size; i++)
+		strlist_append(&config->pchinputs, old.inputs.strs[i]);
+
+	if (config->ccfamily == CC_GCC) {
+		*strrchr(output, '.') = 0;
+		if (!write_stub(output, header))
+			goto end;
+		strlist_append(&config->pchflags, "-include");
+	} else {
+		strlist_append(&config->pchflags, "-include-pch");
+	}
+
+	strlist_append(&config->pchflags, output);
+
+end:
+	objstate_free(&old);
+	strlist_free(&argv);
+	free(statepath);
+	free(depfile);
+	free(output);
+	free(header);
+	free(pchdir);
+	free(dir);
+	free(cmd);
+}
+
+static void pch_command(struct config *config, char *header, char *output,
+		char *depfile, struct strlist *argv)
+{
+	char *lang;
+
+	/* A header has no extension telling the language, so guess it from
+	   the compiler, like g++ or clang++. */
+	lang = strstr(config->cc, "++") ? "c++-header" : "c-header";
+
+	strsplit(argv, config->cc);
+	strlist_append(argv, "-x");
+	strlist_append(argv, lang);
+	strlist_append(argv, "-o");
+	strlist_append(argv, output);
+	strlist_append(argv, header);
+	strlist_append(argv, "-MMD");
+	strlist_append(argv, "-MF");
+	strlist_append(argv, depfile);
+
+	for (size_t i = 0; i < config->flags.size; i++)
+		strlist_append(argv, config->flags.strs[i]);
+}
+
+static bool write_stub(char *path, char *header)
+{
+	char buf[LINESIZE], cur[LINESIZE] = {0};
+	FILE *f;
+
+	/* Don't touch it if it's the same, as objects depend on it. */
+	snprintf(buf, LINESIZE, "#include \"%s\"\n", header);
+	f = fopen(path, "r");
+	if (f) {
+		fread(cur, 1, LINESIZE - 1, f);
+		fclose(f);
+		if (!strcmp(cur, buf))
+			return true;
+	}
+
+	f = fopen(path, "w");
+	if (!f)
+		return false;
+
+	fputs(buf, f);
+	return !fclose(f);
+}
+
+static void remove_stale(char *dir, char *keep)
+{
+	struct dirent *ent;
+	char *path;
+	DIR *d;
+
+	d = opendir(dir);
+	if (!d)
+		return;
+
+	while ((ent = readdir(d))) {
+		if (ent->d_name[0] == '.' || !strcmp(ent->d_name, keep))
+			continue;
+
+		path = malloc(strlen(dir) + strlen(ent->d_name) + 2);
+		sprintf(path, "%s/%s", dir, ent->d_name);
+		removedir(path);
+		free(path);
+	}
+
+	closedir(d);
+}
@@ -0,0 +1,802 @@
+/*
+ * remote.c - compiling on other machines
+ * Copyright (c) 2022 mini-rose
+ */
+
+#include "build.h"
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <spawn.h>
+
+extern char **environ;
+
+
+/* A worker is `build -W <address>` running on another machine, or on this
+   one for testing. Sources are still preprocessed here, so the worker does
+   not need the headers of the project, only the same compiler. For each
+   remote compile, build starts itself as a helper ("build --remote"), which
+   preprocesses the source, sends it with the compile flags to the worker
+   and writes the object it gets back. To the job loop, the helper is just
+   another process with an exit status. If the worker cannot be reached, or
+   goes away in the middle, the helper compiles the preprocessed source
+   itself.
+
+   Every message is a sequence of little-endian integers & strings, like
+   the snapshot. After a handshake, where the worker tells how many jobs it
+   runs at once, the client sends the compiler arguments, the extension of
+   the preprocessed source and the source. The worker answers with the exit
+   status, what the compiler printed and the object.
+
+   The worker only runs the compilers it was started with, and only with
+   options from a list which cannot load code or touch files outside of its
+   temporary directory. Other jobs, and jobs it cannot set up, get the
+   REMOTE_REFUSED status, so the client compiles them itself. */
+
+#define REMOTE_MAGIC        "BLDWRK"
+#define REMOTE_PROBE        0
+#define REMOTE_JOB          1
+
+/* The status of a job the worker did not run. */
+#define REMOTE_REFUSED      UINT32_MAX
+
+/* How long to wait for a worker to accept the connection, in ms. */
+#define CONNECT_TIMEOUT     2000
+
+/* The largest string, source or object we accept, so a broken length
+   doesn't make us allocate everything. */
+#define REMOTE_MAXBLOB      (256 << 20)
+
+/* Bytes received or to send. */
+struct blob
+{
+	char *data;
+	size_t len;
+};
+
+static char *self_path;
+
+/* The compilers the worker runs. */
+static struct strlist *worker_cc;
+
+/* Options a worker passes to the compiler. Those with the prefixes of
+   denied_options are not, even if they match one here. */
+static const char *const allowed_options[] = {
+	"-c", "-O", "-g", "-f", "-m", "-W", "-w", "-D", "-U", "-std=", "-pipe",
+	"-pedantic", "-ansi", "-pthread"
+};
+static const char *const denied_options[] = {
+	"-Wa,", "-Wl,", "-Wp,", "-mllvm", "-fplugin", "-fpass-plugin",
+	"-fdump", "-fprofile", "-fauto-profile", "-fopt-info",
+	"-fsave-optimization-record", "-fcallgraph-info", "-fmodule",
+	"-fcrash-diagnostics", "-ftime-trace="
+};
+
+/* Connect to "host:port", or to a Unix socket if the address has a "/".
+   Returns the socket, or -1. */
+static int remote_connect(char *addr);
+
+/* Send the handshake & the request type. Returns the slots of the worker,
+   or 0 if it is no worker or another version. */
+static int handshake(int fd, uint32_t type);
+
+/* Run the preprocessor with its output in `out`. Returns the exit status. */
+static int preprocess(char **argv, struct blob *out);
+
+/* Compile the preprocessed source on the worker. Returns false if the
+   worker failed, otherwise the exit status of the compiler is in
+   `status`. */
+static bool compile_remote(char *addr, struct strlist *argv, char *ext,
+		struct blob *source, char *object, int *status);
+static int compile_local(struct strlist *argv, char *ext,
+		struct blob *source, char *object);
+
+/* Handle a connection of the worker. */
+static void serve(int fd, int slots);
+static void serve_job(int fd);
+
+/* Returns true if the worker may run the compiler arguments. */
+static bool job_allowed(struct strlist *argv);
+static bool has_prefix(const char *str, const char *const *prefixes,
+		size_t n);
+
+static bool send_all(int fd, const void *buf, size_t len);
+static bool recv_all(int fd, void *buf, size_t len);
+static bool send_u32(int fd, uint32_t val);
+static bool send_blob(int fd, const void *buf, size_t len);
+static bool recv_u32(int fd, uint32_t *val);
+static bool recv_blob(int fd, struct blob *buf);
+static bool write_file(char *path, struct blob *buf);
+static bool read_file(char *path, struct blob *buf);
+static void blob_append(struct blob *buf, const void *data, size_t len);
+
+
+void remote_init(char *argv0)
+{
+	char path[PATH_MAX];
+
+	/* The helpers are started as the same binary. */
+	if (realpath("/proc/self/exe", path) || realpath(argv0, path))
+		self_path = strdup(path);
+	else
+		self_path = strdup(argv0);
+}
+
+size_t remote_probe(struct config *config, struct worker **workers)
+{
+	struct strlist addrs = {0};
+	char *env;
+	size_t n = 0;
+	int fd, slots;
+
+	/* The environment is about this machine, the buildfile about the
+	   project, so the environment wins. */
+	env = getenv("BUILD_WORKERS");
+	if (env)
+		strsplit(&addrs, env);
+	else
+		for (size_t i = 0; i < config->workers.size; i++)
+			strlist_append(&addrs, config->workers.strs[i]);
+
+	*workers = calloc(addrs.size + 1, sizeof(**workers));
+	for (size_t i = 0; i < addrs.size; i++) {
+		fd = remote_connect(addrs.strs[i]);
+		slots = fd == -1 ? 0 : handshake(fd, REMOTE_PROBE);
+		if (fd != -1)
+			close(fd);
+
+		if (slots <= 0) {
+			fprintf(stderr, "build: worker %s is not available, "
+					"compiling without it\n", addrs.strs[i]);
+			continue;
+		}
+
+		if (config->explain)
+			printf("worker: %s (%d slots)\n", addrs.strs[i], slots);
+		(*workers)[n].addr = strdup(addrs.strs[i]);
+		(*workers)[n++].slots = slots;
+	}
+
+	strlist_free(&addrs);
+	return n;
+}
+
+void remote_free(struct worker *workers, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		free(workers[i].addr);
+	free(workers);
+}
+
+void remote_command(char *addr, char *source, char *object,
+		struct strlist *preprocess, struct strlist *compile,
+		struct strlist *argv)
+{
+	char *ext;
+
+	/* The extension tells the compiler on the worker, that the source is
+	   already preprocessed. */
+	ext = strrchr(source, '.');
+	ext = ext && strcmp(ext, ".c") ? ".ii" : ".i";
+
+	strlist_append(argv, self_path);
+	strlist_append(argv, "--remote");
+	strlist_append(argv, addr);
+	strlist_append(argv, object);
+	strlist_append(argv, ext);
+	strlist_appendf(argv, "%zu", preprocess->size);
+	for (size_t i = 0; i < preprocess->size; i++)
+		strlist_append(argv, preprocess->strs[i]);
+	for (size_t i = 0; i < compile->size; i++)
+		strlist_append(argv, compile->strs[i]);
+}
+
+int remote_main(int argc, char **argv)
+{
+	struct strlist pre = {0}, compile = {0};
+	struct blob source = {0};
+	char *addr, *object, *ext;
+	int status;
+	size_t n;
+
+	if (argc < 5 || (size_t) argc < 4 + (n = atoi(argv[3]))) {
+		fputs("build: usage: build --remote <addr> <object> <ext> <n> "
+				"<preprocess...> <compile...>\n", stderr);
+		return 1;
+	}
+
+	addr = argv[0];
+	object = argv[1];
+	ext = argv[2];
+	for (size_t i = 4; i < 4 + n; i++)
+		strlist_append(&pre, argv[i]);
+	for (int i = 4 + n; i < argc; i++)
+		strlist_append(&compile, argv[i]);
+
+	/* A worker going away must not kill us while sending. */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Errors in the source show up here, like when compiling locally. */
+	status = preprocess(strlist_terminate(&pre), &source);
+	if (status)
+		goto end;
+
+	if (!compile_remote(addr, &compile, ext, &source, object, &status)) {
+		fprintf(stderr, "build: worker %s failed or refused, compiling %s "
+				"here\n", addr, object);
+		status = compile_local(&compile, ext, &source, object);
+	}
+
+end:
+	strlist_free(&pre);
+	strlist_free(&compile);
+	free(source.data);
+	return status;
+}
+
+int worker_run(char *addr, int slots, struct strlist *cc)
+{
+	struct sockaddr_un un = { .sun_family = AF_UNIX };
+	struct addrinfo hints = {0}, *res;
+	int fd, conn, one = 1, running = 0;
+	char *host, *port;
+	pid_t pid;
+
+	if (!cc->size) {
+		fputs("build: -W needs the compilers the worker may run, "
+				"like -W :9000 gcc\n", stderr);
+		return 1;
+	}
+
+	worker_cc = cc;
+	if (slots <= 0)
+		slots = get_nprocs();
+
+	if (strchr(addr, '/')) {
+		if (!strncmp(addr, "unix:", 5))
+			addr += 5;
+		if (strlen(addr) >= sizeof(un.sun_path)) {
+			fprintf(stderr, "build: socket path too long: %s\n", addr);
+			return 1;
+		}
+
+		strcpy(un.sun_path, addr);
+		unlink(addr);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd == -1 || bind(fd, (struct sockaddr *) &un, sizeof(un))) {
+			perror("build: cannot listen");
+			return 1;
+		}
+	} else {
+		host = strdup(addr);
+		port = strrchr(host, ':');
+		if (!port) {
+			fprintf(stderr, "build: expected host:port, got %s\n", addr);
+			free(host);
+			return 1;
+		}
+		*port++ = 0;
+
+		/* Without a host, only this machine can connect. */
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(*host ? host : "127.0.0.1", port, &hints, &res)) {
+			fprintf(stderr, "build: cannot resolve %s\n", addr);
+			free(host);
+			return 1;
+		}
+		free(host);
+
+		fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+		if (fd != -1)
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (fd == -1 || bind(fd, res->ai_addr, res->ai_addrlen)) {
+			perror("build: cannot listen");
+			freeaddrinfo(res);
+			return 1;
+		}
+		freeaddrinfo(res);
+	}
+
+	if (listen(fd, 64)) {
+		perror("build: cannot listen");
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("build: worker listening on %s with %d slots\n", addr, slots);
+	fflush(stdout);
+
+	while (1) {
+		/* Every connection is handled by its own process, with no more of
+		   them than the slots we advertise. The others wait in the backlog
+		   until one is done. */
+		while (running) {
+			pid = waitpid(-1, NULL, running >= slots ? 0 : WNOHANG);
+			if (pid == -1 && errno == EINTR)
+				continue;
+			if (pid == 0)
+				break;
+			running = pid == -1 ? 0 : running - 1;
+		}
+
+		conn = accept(fd, NULL, NULL);
+		if (conn == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("build: accept failed");
+			return 1;
+		}
+
+		pid = fork();
+		if (pid == 0) {
+			close(fd);
+			serve(conn, slots);
+			_exit(0);
+		}
+
+		if (pid > 0)
+			running++;
+		close(conn);
+	}
+}
+
+static int remote_connect(char *addr)
+{
+	struct sockaddr_un un = { .sun_family = AF_UNIX };
+	struct addrinfo hints = {0}, *res, *ai;
+	struct pollfd pfd;
+	char *host, *port;
+	int fd = -1, err;
+	socklen_t len;
+
+	if (strchr(addr, '/')) {
+		if (!strncmp(addr, "unix:", 5))
+			addr += 5;
+		if (strlen(addr) >= sizeof(un.sun_path))
+			return -1;
+
+		strcpy(un.sun_path, addr);
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd != -1 && connect(fd, (struct sockaddr *) &un, sizeof(un))) {
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	host = strdup(addr);
+	port = strrchr(host, ':');
+	if (!port) {
+		free(host);
+		return -1;
+	}
+	*port++ = 0;
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &res)) {
+		free(host);
+		return -1;
+	}
+	free(host);
+
+	/* Connect without blocking, so a machine that is down only costs the
+	   timeout. */
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+				ai->ai_protocol);
+		if (fd == -1)
+			continue;
+
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		err = connect(fd, ai->ai_addr, ai->ai_addrlen) ? errno : 0;
+		if (err == EINPROGRESS) {
+			pfd = (struct pollfd) { .fd = fd, .events = POLLOUT };
+			len = sizeof(err);
+			if (poll(&pfd, 1, CONNECT_TIMEOUT) != 1
+					|| getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len))
+				err = ETIMEDOUT;
+		}
+
+		if (!err) {
+			fcntl(fd, F_SETFL, 0);
+			break;
+		}
+
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+	return fd;
+}
+
+static int handshake(int fd, uint32_t type)
+{
+	char magic[sizeof(REMOTE_MAGIC)];
+	uint32_t version, slots;
+
+	if (!send_all(fd, REMOTE_MAGIC, sizeof(REMOTE_MAGIC))
+			|| !send_u32(fd, BUILD_VERSION) || !send_u32(fd, type))
+		return 0;
+
+	if (!recv_all(fd, magic, sizeof(magic)) || memcmp(magic, REMOTE_MAGIC,
+				sizeof(magic)) || !recv_u32(fd, &version)
+			|| version != BUILD_VERSION || !recv_u32(fd, &slots))
+		return 0;
+
+	return slots;
+}
+
+static int preprocess(char **argv, struct blob *out)
+{
+	posix_spawn_file_actions_t actions;
+	struct proc_result res = {0};
+	char buf[LINESIZE * 4];
+	int fds[2], ret;
+	ssize_t n;
+
+	if (pipe(fds) == -1)
+		return 127;
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+	posix_spawn_file_actions_addclose(&actions, fds[0]);
+	ret = posix_spawnp(&res.pid, argv[0], &actions, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	close(fds[1]);
+
+	if (ret) {
+		fprintf(stderr, "build: failed to run %s: %s\n", argv[0],
+				strerror(ret));
+		close(fds[0]);
+		return 127;
+	}
+
+	while ((n = read(fds[0], buf, sizeof(buf))) != 0) {
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			break;
+		blob_append(out, buf, n);
+	}
+
+	close(fds[0]);
+	res.start = clock_now();
+	proc_wait(res.pid, true, &res);
+	return res.status;
+}
+
+static bool compile_remote(char *addr, struct strlist *argv, char *ext,
+		struct blob *source, char *object, int *status)
+{
+	struct blob log = {0}, obj = {0};
+	uint32_t val;
+	bool ok;
+	int fd;
+
+	fd = remote_connect(addr);
+	if (fd == -1)
+		return false;
+
+	ok = handshake(fd, REMOTE_JOB) > 0 && send_u32(fd, argv->size);
+	for (size_t i = 0; ok && i < argv->size; i++)
+		ok = send_blob(fd, argv->strs[i], strlen(argv->strs[i]));
+	ok = ok && send_blob(fd, ext, strlen(ext))
+		&& send_blob(fd, source->data, source->len)
+		&& recv_u32(fd, &val) && recv_blob(fd, &log) && recv_blob(fd, &obj);
+	close(fd);
+
+	/* A refused job has the reason in the log. */
+	if (ok)
+		fwrite(log.data, 1, log.len, stderr);
+	if (ok && val == REMOTE_REFUSED)
+		ok = false;
+
+	if (ok) {
+		*status = val;
+		if (!*status && !write_file(object, &obj)) {
+			fprintf(stderr, "build: cannot write %s\n", object);
+			*status = 1;
+		}
+	}
+
+	free(log.data);
+	free(obj.data);
+	return ok;
+}
+
+static int compile_local(struct strlist *argv, char *ext,
+		struct blob *source, char *object)
+{
+	struct proc_result res;
+	struct strlist cmd = {0};
+	char *path;
+
+	path = malloc(strlen(object) + strlen(ext) + 1);
+	sprintf(path, "%s%s", object, ext);
+	if (!write_file(path, source)) {
+		fprintf(stderr, "build: cannot write %s\n", path);
+		free(path);
+		return 1;
+	}
+
+	for (size_t i = 0; i < argv->size; i++)
+		strlist_append(&cmd, argv->strs[i]);
+	strlist_append(&cmd, path);
+	strlist_append(&cmd, "-o");
+	strlist_append(&cmd, object);
+
+	run_cmd(&cmd, false, &res);
+	unlink(path);
+	strlist_free(&cmd);
+	free(path);
+	return res.status;
+}
+
+static void serve(int fd, int slots)
+{
+	char magic[sizeof(REMOTE_MAGIC)];
+	uint32_t version, type;
+
+	if (!recv_all(fd, magic, sizeof(magic)) || memcmp(magic, REMOTE_MAGIC,
+				sizeof(magic)) || !recv_u32(fd, &version)
+			|| !recv_u32(fd, &type))
+		return;
+
+	/* Another version may send other arguments, so it gets no slots. */
+	if (!send_all(fd, REMOTE_MAGIC, sizeof(REMOTE_MAGIC))
+			|| !send_u32(fd, BUILD_VERSION)
+			|| !send_u32(fd, version == BUILD_VERSION ? slots : 0))
+		return;
+
+	if (version == BUILD_VERSION && type == REMOTE_JOB)
+		serve_job(fd);
+}
+
+static void serve_job(int fd)
+{
+	struct blob arg = {0}, ext = {0}, source = {0}, log = {0}, obj = {0};
+	struct strlist argv = {0};
+	struct proc_result res;
+	char dir[] = "/tmp/build-worker.XXXXXX", *tmpdir, *in, *out, *logpath;
+	char msg[LINESIZE];
+	uint32_t n, status;
+	bool ok;
+
+	ok = recv_u32(fd, &n) && n;
+	for (uint32_t i = 0; ok && i < n; i++) {
+		ok = recv_blob(fd, &arg);
+		if (ok)
+			strlist_append(&argv, arg.data);
+		arg.len = 0;
+	}
+
+	/* The extension becomes part of a path. */
+	ok = ok && recv_blob(fd, &ext) && recv_blob(fd, &source)
+		&& (!strcmp(ext.data, ".i") || !strcmp(ext.data, ".ii"));
+	if (!ok)
+		goto end;
+
+	tmpdir = job_allowed(&argv) ? mkdtemp(dir) : NULL;
+	if (!tmpdir) {
+		snprintf(msg, sizeof(msg), "build: the worker does not run this "
+				"%s command\n", argv.strs[0]);
+		send_u32(fd, REMOTE_REFUSED);
+		send_blob(fd, msg, strlen(msg));
+		send_blob(fd, NULL, 0);
+		goto end;
+	}
+
+	in = malloc(strlen(tmpdir) + 16);
+	out = malloc(strlen(tmpdir) + 16);
+	logpath = malloc(strlen(tmpdir) + 16);
+	sprintf(in, "%s/in%s", tmpdir, ext.data);
+	sprintf(out, "%s/out.o", tmpdir);
+	sprintf(logpath, "%s/log", tmpdir);
+
+	/* Only what the compiler says is a compile error, the rest is ours. */
+	status = REMOTE_REFUSED;
+	if (write_file(in, &source)) {
+		strlist_append(&argv, in);
+		strlist_append(&argv, "-o");
+		strlist_append(&argv, out);
+
+		res.start = clock_now();
+		res.pid = spawn_argv(strlist_terminate(&argv), logpath);
+		if (res.pid != -1 && proc_wait(res.pid, true, &res))
+			status = res.status;
+	}
+
+	read_file(logpath, &log);
+	if (!status && !read_file(out, &obj))
+		status = REMOTE_REFUSED;
+
+	send_u32(fd, status);
+	send_blob(fd, log.data, log.len);
+	send_blob(fd, obj.data, obj.len);
+
+	unlink(in);
+	unlink(out);
+	unlink(logpath);
+	rmdir(tmpdir);
+	free(in);
+	free(out);
+	free(logpath);
+
+end:
+	strlist_free(&argv);
+	free(arg.data);
+	free(ext.data);
+	free(source.data);
+	free(log.data);
+	free(obj.data);
+}
+
+static bool job_allowed(struct strlist *argv)
+{
+	char *val;
+
+	if (strlist_find(worker_cc, argv->strs[0]) == INVALID_INDEX)
+		return false;
+
+	/* The worker adds the source & the output itself, so there are only
+	   options. A path in the value of one could be any file. */
+	for (size_t i = 1; i < argv->size; i++) {
+		if (!has_prefix(argv->strs[i], allowed_options,
+					sizeof(allowed_options) / sizeof(*allowed_options))
+				|| has_prefix(argv->strs[i], denied_options,
+					sizeof(denied_options) / sizeof(*denied_options)))
+			return false;
+
+		val = strchr(argv->strs[i], '=');
+		if (!strncmp(argv->strs[i], "-f", 2) && val && strchr(val, '/'))
+			return false;
+	}
+
+	return true;
+}
+
+static bool has_prefix(const char *str, const char *const *prefixes,
+		size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		if (!strncmp(str, prefixes[i], strlen(prefixes[i])))
+			return true;
+	}
+
+	return false;
+}
+
+static bool send_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+static bool recv_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = recv(fd, p, len, 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+static bool send_u32(int fd, uint32_t val)
+{
+	unsigned char buf[4];
+
+	for (int i = 0; i < 4; i++)
+		buf[i] = val >> (i * 8);
+	return send_all(fd, buf, 4);
+}
+
+static bool send_blob(int fd, const void *buf, size_t len)
+{
+	return send_u32(fd, len) && send_all(fd, buf, len);
+}
+
+static bool recv_u32(int fd, uint32_t *val)
+{
+	unsigned char buf[4];
+
+	if (!recv_all(fd, buf, 4))
+		return false;
+
+	*val = 0;
+	for (int i = 0; i < 4; i++)
+		*val |= (uint32_t) buf[i] << (i * 8);
+	return true;
+}
+
+static bool recv_blob(int fd, struct blob *buf)
+{
+	uint32_t len;
+
+	if (!recv_u32(fd, &len) || len > REMOTE_MAXBLOB)
+		return false;
+
+	/* Keep it a string, for the arguments. */
+	buf->data = realloc(buf->data, len + 1);
+	buf->len = len;
+	buf->data[len] = 0;
+	return recv_all(fd, buf->data, len);
+}
+
+static bool write_file(char *path, struct blob *buf)
+{
+	char *tmp;
+	bool ok;
+	FILE *f;
+
+	/* Replace the file at once, like the snapshot. */
+	tmp = malloc(strlen(path) + 5);
+	sprintf(tmp, "%s.tmp", path);
+
+	f = fopen(tmp, "wb");
+	ok = f && fwrite(buf->data, 1, buf->len, f) == buf->len;
+	if (f && fclose(f))
+		ok = false;
+	if (ok && rename(tmp, path))
+		ok = false;
+	if (!ok)
+		unlink(tmp);
+
+	free(tmp);
+	return ok;
+}
+
+static bool read_file(char *path, struct blob *buf)
+{
+	char chunk[LINESIZE * 4];
+	size_t n;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return false;
+
+	while ((n = fread(chunk, 1, sizeof(chunk), f)))
+		blob_append(buf, chunk, n);
+
+	fclose(f);
+	return true;
+}
+
+static void blob_append(struct blob *buf, const void *data, size_t len)
+{
+	buf->data = realloc(buf->data, buf->len + len + 1);
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+	buf->data[buf->len] = 0;
+}
@@ -0,0 +1,468 @@
+/*
+ * snapshot.c - cached result of parsing the buildfile
+ * Copyright (c) 2022 mini-rose
+ */
+
+#include "build.h"
+#include <sys/mman.h>
+#include <fcntl.h>
+
+
+/* After parsing the buildfile and expanding the wildcards, the config is
+   saved into "config.snapshot" in the build directory. The next run takes
+   it from there, as long as the buildfile has the same hash and all the
+   directories the walker read still have the same mtime, which changes
+   whenever an entry is added, removed or renamed in the directory. So a
+   big tree is not walked again, until a file is added or removed.
+
+   The snapshot is a sequence of little-endian integers & strings, read
+   from a single mmap. Strings are a 32-bit length followed by the bytes,
+   with a length of SNAPSHOT_NULL for a missing string. */
+
+#define SNAPSHOT_NAME       "config.snapshot"
+#define SNAPSHOT_MAGIC      "BLDSNAP"
+#define SNAPSHOT_NULL       0xffffffffU
+
+struct reader
+{
+	const char *p;
+	const char *end;
+	bool bad;
+};
+
+/* Read the buildfile, returning its hash and the path of the snapshot,
+   which depends on the builddir option. Returns NULL if the buildfile
+   cannot be read. */
+static char *snapshot_path(struct config *config, uint64_t *hash);
+static bool in_builddir(struct config *config, char *dir);
+
+static void put_u32(FILE *f, uint32_t val);
+static void put_u64(FILE *f, uint64_t val);
+static void put_str(FILE *f, const char *str);
+static void put_strlist(FILE *f, struct strlist *list);
+
+static uint32_t get_u32(struct reader *r);
+static uint64_t get_u64(struct reader *r);
+static char *get_str(struct reader *r);
+static void get_strlist(struct reader *r, struct strlist *list);
+
+/* Fill `config` from the snapshot. Returns false if it is invalid or out
+   of date. */
+static bool read_snapshot(struct reader *r, uint64_t hash,
+		struct config *config);
+
+
+int snapshot_load(struct config *config)
+{
+	struct config_field fields[CONFIG_MAXFIELDS], snapfields[CONFIG_MAXFIELDS];
+	struct config snap = {0};
+	struct reader r;
+	size_t nfields;
+	uint64_t hash;
+	struct stat st;
+	char *path;
+	void *map;
+	bool ok;
+	int fd;
+
+	path = snapshot_path(config, &hash);
+	if (!path)
+		return 1;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+	if (fd == -1)
+		return 1;
+
+	if (fstat(fd, &st) == -1 || !st.st_size) {
+		close(fd);
+		return 1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 1;
+
+	r = (struct reader) { .p = map, .end = (char *) map + st.st_size };
+	ok = read_snapshot(&r, hash, &snap);
+	munmap(map, st.st_size);
+
+	if (!ok) {
+		config_free(&snap);
+		return 1;
+	}
+
+	/* Move the options over, the rest of `config` is from the command
+	   line. */
+	nfields = buildfile_fields(config, fields);
+	buildfile_fields(&snap, snapfields);
+	for (size_t i = 0; i < nfields; i++) {
+		if (fields[i].type == FIELD_STR) {
+			free(* (char **) fields[i].val);
+			* (char **) fields[i].val = * (char **) snapfields[i].val;
+		} else {
+			strlist_free(fields[i].val);
+			* (struct strlist *) fields[i].val =
+				* (struct strlist *) snapfields[i].val;
+		}
+	}
+
+	config->user_sources = snap.user_sources;
+	config->targets = snap.targets;
+	config->ntargets = snap.ntargets;
+	config->artifacts = snap.artifacts;
+	config->nartifacts = snap.nartifacts;
+	config->variants = snap.variants;
+	config->nvariants = snap.nvariants;
+
+	if (config->explain)
+		printf("snapshot: loaded %s/" SNAPSHOT_NAME "\n", config->builddir);
+	return 0;
+}
+
+void snapshot_save(struct config *config, struct strmap *dirs)
+{
+	struct config_field fields[CONFIG_MAXFIELDS];
+	struct artifact *a;
+	struct variant *v;
+	struct target *t;
+	size_t nfields, ndirs;
+	char *path, *tmp;
+	uint64_t hash;
+	FILE *f;
+
+	path = snapshot_path(config, &hash);
+	if (!path)
+		return;
+
+	mkdir_p(config->builddir);
+	tmp = malloc(strlen(path) + 8);
+	sprintf(tmp, "%s.tmp", path);
+
+	f = fopen(tmp, "wb");
+	if (!f)
+		goto end;
+
+	fwrite(SNAPSHOT_MAGIC, 1, sizeof(SNAPSHOT_MAGIC), f);
+	put_u32(f, BUILD_VERSION);
+	put_u64(f, hash);
+
+	/* The build directory changes with every build, and only has generated
+	   files, which are never sources. */
+	ndirs = 0;
+	for (size_t i = 0; i < dirs->size; i++) {
+		if (dirs->slots[i].key && !in_builddir(config, dirs->slots[i].key))
+			ndirs++;
+	}
+
+	put_u32(f, ndirs);
+	for (size_t i = 0; i < dirs->size; i++) {
+		if (!dirs->slots[i].key || in_builddir(config, dirs->slots[i].key))
+			continue;
+		put_u64(f, dirs->slots[i].val);
+		put_str(f, dirs->slots[i].key);
+	}
+
+	nfields = buildfile_fields(config, fields);
+	put_u32(f, nfields);
+	for (size_t i = 0; i < nfields; i++) {
+		if (fields[i].type == FIELD_STR)
+			put_str(f, * (char **) fields[i].val);
+		else
+			put_strlist(f, fields[i].val);
+	}
+
+	put_u32(f, config->user_sources);
+
+	put_u32(f, config->ntargets);
+	for (size_t i = 0; i < config->ntargets; i++) {
+		t = config->targets[i];
+		put_str(f, t->name);
+		put_strlist(f, &t->needs);
+		put_strlist(f, &t->cmds);
+	}
+
+	put_u32(f, config->nartifacts);
+	for (size_t i = 0; i < config->nartifacts; i++) {
+		a = config->artifacts[i];
+		put_str(f, a->name);
+		put_strlist(f, &a->sources);
+		put_strlist(f, &a->flags);
+		put_strlist(f, &a->libraries);
+		put_strlist(f, &a->needs);
+		put_str(f, a->out);
+		put_str(f, a->kind);
+	}
+
+	put_u32(f, config->nvariants);
+	for (size_t i = 0; i < config->nvariants; i++) {
+		v = config->variants[i];
+		put_str(f, v->name);
+		put_str(f, v->cc);
+		put_strlist(f, &v->flags);
+		put_str(f, v->out);
+		put_str(f, v->builddir);
+	}
+
+	/* Replace the old one at once, so a parallel build never reads half
+	   of it. */
+	if (fclose(f) || rename(tmp, path))
+		unlink(tmp);
+
+end:
+	free(tmp);
+	free(path);
+}
+
+static char *snapshot_path(struct config *config, uint64_t *hash)
+{
+	char *contents, *line, *next, *val, *builddir = NULL, *path;
+	bool variant = false;
+	size_t size, len;
+	FILE *f;
+
+	f = fopen(config->buildfile, "r");
+	if (!f)
+		return NULL;
+
+	contents = NULL;
+	size = 0;
+	do {
+		contents = realloc(contents, size + LINESIZE + 1);
+		len = fread(contents + size, 1, LINESIZE, f);
+		size += len;
+	} while (len == LINESIZE);
+
+	fclose(f);
+	contents[size] = 0;
+	*hash = hash_bytes(HASH_INIT, contents, size);
+
+	/* The snapshot is in the build directory, so find the builddir option
+	   without parsing the rest. A builddir in a variant section, up to the
+	   next artifact line, is the variant's. */
+	for (line = contents; line && *line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = 0;
+
+		if (!strncmp(line, "variant", 7) && (!line[7]
+					|| iswhitespace(line[7]))) {
+			val = strlstrip(line + 7);
+			variant = *val;
+			free(val);
+			continue;
+		}
+
+		if (!strncmp(line, "artifact", 8) && (!line[8]
+					|| iswhitespace(line[8])))
+			variant = false;
+
+		if (variant || strncmp(line, "builddir", 8)
+				|| !iswhitespace(line[8]))
+			continue;
+
+		val = strlstrip(line + 9);
+		val[linelen(val)] = 0;
+		while (*val && iswhitespace(val[strlen(val) - 1]))
+			val[strlen(val) - 1] = 0;
+		free(builddir);
+		builddir = val;
+	}
+
+	if (!builddir)
+		builddir = strdup(BUILD_DIR);
+
+	path = malloc(strlen(builddir) + strlen(SNAPSHOT_NAME) + 2);
+	sprintf(path, "%s/" SNAPSHOT_NAME, builddir);
+
+	free(builddir);
+	free(contents);
+	return path;
+}
+
+static bool in_builddir(struct config *config, char *dir)
+{
+	size_t len = strlen(config->builddir);
+
+	return !strncmp(dir, config->builddir, len)
+		&& (!dir[len] || dir[len] == '/');
+}
+
+static bool read_snapshot(struct reader *r, uint64_t hash,
+		struct config *config)
+{
+	struct config_field fields[CONFIG_MAXFIELDS];
+	struct artifact *a;
+	struct variant *v;
+	struct target *t;
+	size_t nfields;
+	int64_t mtime;
+	uint32_t n;
+	char *str;
+
+	if (r->end - r->p < (long) sizeof(SNAPSHOT_MAGIC)
+			|| memcmp(r->p, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)))
+		return false;
+	r->p += sizeof(SNAPSHOT_MAGIC);
+
+	if (get_u32(r) != BUILD_VERSION || get_u64(r) != hash)
+		return false;
+
+	n = get_u32(r);
+	for (uint32_t i = 0; i < n && !r->bad; i++) {
+		mtime = get_u64(r);
+		str = get_str(r);
+		if (!str || file_mtime(str) != mtime) {
+			free(str);
+			return false;
+		}
+		free(str);
+	}
+
+	nfields = buildfile_fields(config, fields);
+	if (get_u32(r) != nfields)
+		return false;
+
+	for (size_t i = 0; i < nfields; i++) {
+		if (fields[i].type == FIELD_STR)
+			* (char **) fields[i].val = get_str(r);
+		else
+			get_strlist(r, fields[i].val);
+	}
+
+	config->user_sources = get_u32(r);
+
+	n = get_u32(r);
+	for (uint32_t i = 0; i < n && !r->bad; i++) {
+		str = get_str(r);
+		if (!str)
+			return false;
+		t = config_add_target(config, str);
+		free(str);
+		get_strlist(r, &t->needs);
+		get_strlist(r, &t->cmds);
+	}
+
+	n = get_u32(r);
+	for (uint32_t i = 0; i < n && !r->bad; i++) {
+		str = get_str(r);
+		if (!str)
+			return false;
+		a = config_add_artifact(config, str);
+		free(str);
+		get_strlist(r, &a->sources);
+		get_strlist(r, &a->flags);
+		get_strlist(r, &a->libraries);
+		get_strlist(r, &a->needs);
+		a->out = get_str(r);
+		a->kind = get_str(r);
+	}
+
+	n = get_u32(r);
+	for (uint32_t i = 0; i < n && !r->bad; i++) {
+		str = get_str(r);
+		if (!str)
+			return false;
+		v = config_add_variant(config, str);
+		free(str);
+		v->cc = get_str(r);
+		get_strlist(r, &v->flags);
+		v->out = get_str(r);
+		v->builddir = get_str(r);
+	}
+
+	return !r->bad && r->p == r->end;
+}
+
+static void put_u32(FILE *f, uint32_t val)
+{
+	unsigned char buf[4];
+
+	for (int i = 0; i < 4; i++)
+		buf[i] = val >> (i * 8);
+	fwrite(buf, 1, 4, f);
+}
+
+static void put_u64(FILE *f, uint64_t val)
+{
+	put_u32(f, val);
+	put_u32(f, val >> 32);
+}
+
+static void put_str(FILE *f, const char *str)
+{
+	if (!str) {
+		put_u32(f, SNAPSHOT_NULL);
+		return;
+	}
+
+	put_u32(f, strlen(str));
+	fwrite(str, 1, strlen(str), f);
+}
+
+static void put_strlist(FILE *f, struct strlist *list)
+{
+	put_u32(f, list->size);
+	for (size_t i = 0; i < list->size; i++)
+		put_str(f, list->strs[i]);
+}
+
+static uint32_t get_u32(struct reader *r)
+{
+	const unsigned char *p = (const unsigned char *) r->p;
+	uint32_t val = 0;
+
+	if (r->bad || r->end - r->p < 4) {
+		r->bad = true;
+		return 0;
+	}
+
+	for (int i = 0; i < 4; i++)
+		val |= (uint32_t) p[i] << (i * 8);
+	r->p += 4;
+	return val;
+}
+
+static uint64_t get_u64(struct reader *r)
+{
+	uint64_t low = get_u32(r);
+
+	return low | (uint64_t) get_u32(r) << 32;
+}
+
+static char *get_str(struct reader *r)
+{
+	uint32_t len;
+	char *str;
+
+	len = get_u32(r);
+	if (r->bad || len == SNAPSHOT_NULL)
+		return NULL;
+
+	if ((size_t) (r->end - r->p) < len) {
+		r->bad = true;
+		return NULL;
+	}
+
+	str = strndup(r->p, len);
+	r->p += len;
+	return str;
+}
+
+static void get_strlist(struct reader *r, struct strlist *list)
+{
+	uint32_t n;
+	char *str;
+
+	n = get_u32(r);
+	for (uint32_t i = 0; i < n && !r->bad; i++) {
+		str = get_str(r);
+		if (!str) {
+			r->bad = true;
+			return;
+		}
+		strlist_append(list, str);
+		free(str);
+	}
+}
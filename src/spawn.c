@@ -0,0 +1,225 @@
+/*
+ * spawn.c - starting & waiting for processes
+ * Copyright (c) 2022 mini-rose
+ */
+
+/* wait4() is not part of POSIX, but both glibc & macOS have it. */
+#define _DEFAULT_SOURCE
+#define _DARWIN_C_SOURCE
+
+#include "build.h"
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <spawn.h>
+#include <time.h>
+
+extern char **environ;
+
+
+/* Characters that make a compile or link command need a shell, because the
+   user may rely on it expanding things like $(pkg-config --cflags x). */
+#define SHELL_CHARS     "$`\\\"'*?[]{}~;&|<>()#"
+
+/* Commands longer than this pass some of their arguments in a response
+   file. Linux limits a single argument to 128 KiB, which is what the whole
+   command is when it runs through `sh -c`. */
+#define RSP_THRESHOLD   (64 * 1024)
+
+static void put_rsp_arg(FILE *f, char *arg);
+
+
+double clock_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+bool needs_shell(struct config *config)
+{
+	/* Only what the user wrote into the buildfile can rely on the shell, a
+	   source like "a (1).c" must be passed as it is. */
+	if (strpbrk(config->cc, SHELL_CHARS))
+		return true;
+
+	for (size_t i = 0; i < config->flags.size; i++) {
+		if (strpbrk(config->flags.strs[i], SHELL_CHARS))
+			return true;
+	}
+
+	for (size_t i = 0; i < config->libraries.size; i++) {
+		if (strpbrk(config->libraries.strs[i], SHELL_CHARS))
+			return true;
+	}
+
+	return false;
+}
+
+bool rspfile_args(struct strlist *argv, size_t first, size_t last,
+		char *path, struct strlist *out)
+{
+	size_t len = 0;
+	FILE *f;
+
+	for (size_t i = 0; i < argv->size; i++)
+		len += strlen(argv->strs[i]) + 1;
+	if (len <= RSP_THRESHOLD || first >= last)
+		return false;
+
+	f = fopen(path, "w");
+	if (!f)
+		return false;
+
+	for (size_t i = first; i < last; i++)
+		put_rsp_arg(f, argv->strs[i]);
+
+	if (fclose(f)) {
+		unlink(path);
+		return false;
+	}
+
+	memset(out, 0, sizeof(*out));
+	for (size_t i = 0; i < first; i++)
+		strlist_append(out, argv->strs[i]);
+	strlist_appendf(out, "@%s", path);
+	for (size_t i = last; i < argv->size; i++)
+		strlist_append(out, argv->strs[i]);
+
+	return true;
+}
+
+pid_t spawn_argv(char **argv, char *errlog)
+{
+	return spawn_redirect(argv, NULL, errlog);
+}
+
+pid_t spawn_redirect(char **argv, char *output, char *errlog)
+{
+	posix_spawn_file_actions_t actions;
+	pid_t pid;
+	int ret;
+
+	/* posix_spawn() uses vfork() or clone(CLONE_VM) where it can, so unlike
+	   system() we don't copy our address space and don't start a shell. */
+
+	posix_spawn_file_actions_init(&actions);
+	if (output) {
+		posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, output,
+				O_WRONLY | O_CREAT | O_TRUNC, 0664);
+	}
+	if (errlog) {
+		posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, errlog,
+				O_WRONLY | O_CREAT | O_TRUNC, 0664);
+	}
+
+	ret = posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+
+	if (ret) {
+		fprintf(stderr, "build: failed to run %s: %s\n", argv[0],
+				strerror(ret));
+		return -1;
+	}
+
+	stats_count(STAT_SPAWNED, 1);
+	if (stats_enabled()) {
+		for (char **arg = argv; *arg; arg++)
+			stats_count(STAT_CMDBYTES, strlen(*arg) + 1);
+	}
+
+	return pid;
+}
+
+pid_t spawn_shell(char *cmd, char *errlog)
+{
+	char *argv[] = {"sh", "-c", cmd, NULL};
+	return spawn_argv(argv, errlog);
+}
+
+pid_t spawn_cmd(struct strlist *argv, bool shell, char *errlog)
+{
+	char *cmd;
+	pid_t pid;
+
+	if (!shell)
+		return spawn_argv(strlist_terminate(argv), errlog);
+
+	cmd = strlist_join(argv, " ");
+	pid = spawn_shell(cmd, errlog);
+	free(cmd);
+	return pid;
+}
+
+bool proc_wait(pid_t pid, bool block, struct proc_result *res)
+{
+	struct rusage ru;
+	int status;
+	pid_t ret;
+
+	do {
+		ret = wait4(pid, &status, block ? 0 : WNOHANG, &ru);
+	} while (ret == -1 && errno == EINTR);
+
+	if (ret <= 0)
+		return false;
+
+	if (WIFEXITED(status))
+		res->status = WEXITSTATUS(status);
+	else
+		res->status = 128 + WTERMSIG(status);
+
+	res->wall = clock_now() - res->start;
+	res->cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+		+ ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+
+	/* Linux reports the max RSS in KiB, macOS in bytes. */
+#if __APPLE__
+	res->maxrss = ru.ru_maxrss / 1024;
+#else
+	res->maxrss = ru.ru_maxrss;
+#endif
+
+	return true;
+}
+
+int run_cmd(struct strlist *argv, bool shell, struct proc_result *res)
+{
+	res->start = clock_now();
+	res->status = 127;
+
+	res->pid = spawn_cmd(argv, shell, NULL);
+	if (res->pid == -1)
+		return res->status;
+
+	proc_wait(res->pid, true, res);
+	return res->status;
+}
+
+int run_shell(char *cmd, struct proc_result *res)
+{
+	res->start = clock_now();
+	res->status = 127;
+
+	res->pid = spawn_shell(cmd, NULL);
+	if (res->pid == -1)
+		return res->status;
+
+	proc_wait(res->pid, true, res);
+	return res->status;
+}
+
+static void put_rsp_arg(FILE *f, char *arg)
+{
+	/* gcc & clang split the file at whitespace, and take the character
+	   after a backslash literally. */
+	for (; *arg; arg++) {
+		if (iswhitespace(*arg) || strchr("\\\"'", *arg))
+			fputc('\\', f);
+		fputc(*arg, f);
+	}
+
+	fputc('\n', f);
+}
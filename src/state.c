@@ -0,0 +1,390 @@
+/*
+ * state.c - per-object build state for incremental builds
+ * Copyright (c) 2022 mini-rose
+ */
+
+#include "build.h"
+#include <fcntl.h>
+
+
+/* Recorded for a header which changed while compiling, so the object never
+   looks up to date. */
+#define MTIME_CHANGED       INT64_MIN
+
+/* While checking which objects are out of date, the same headers get
+   stat'ed for a lot of objects. The mtimes are cached here, and the cache is
+   only used from the main thread. */
+static struct strmap mtime_cache;
+static bool mtime_cache_enabled;
+
+static int unshare_file(char *path);
+static bool find_in_path(char *name, char *buf, size_t size);
+static int64_t stat_mtime(char *path);
+static void add_input_mtime(struct objstate *state, char *path,
+		int64_t mtime);
+static bool is_known_input(struct objstate *state, size_t n, char *path);
+
+
+char *object_path(struct config *config, char *source, const char *ext)
+{
+	char *changed_path, *path;
+	size_t len;
+
+	/* Replace the slashes with another char so we don't have to create
+	   any directories. */
+	changed_path = strdup(source);
+	strreplace(changed_path, '/', '-');
+
+	len = strlen(config->builddir) + strlen(changed_path) + strlen(ext) + 2;
+	path = malloc(len);
+	snprintf(path, len, "%s/%s%s", config->builddir, changed_path, ext);
+
+	free(changed_path);
+	return path;
+}
+
+int64_t file_mtime(char *path)
+{
+	uint64_t mtime;
+
+	if (!mtime_cache_enabled)
+		return stat_mtime(path);
+
+	if (!strmap_get(&mtime_cache, path, &mtime)) {
+		mtime = stat_mtime(path);
+		strmap_set(&mtime_cache, path, mtime);
+	}
+
+	return mtime;
+}
+
+int64_t file_clock(void)
+{
+	struct timespec ts;
+
+	/* The kernel stamps files with the coarse clock, which can be behind
+	   the precise one by a tick. */
+#ifdef CLOCK_REALTIME_COARSE
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_REALTIME, &ts);
+#endif
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void mtime_cache_enable(bool enabled)
+{
+	strmap_free(&mtime_cache);
+	mtime_cache_enabled = enabled;
+}
+
+uint64_t compiler_identity(char *cc)
+{
+	struct strlist words = {0};
+	uint64_t hash = HASH_INIT;
+	char path[PATH_MAX];
+	struct stat st;
+
+	/* Like ccache, we identify the compiler by the path, size & mtime of its
+	   binary instead of running `cc --version`, which is a lot slower. */
+
+	hash = hash_str(hash, cc);
+	strsplit(&words, cc);
+	for (size_t i = 0; i < words.size; i++) {
+		if (!find_in_path(words.strs[i], path, PATH_MAX))
+			continue;
+		if (stat(path, &st) == -1)
+			continue;
+
+		hash = hash_str(hash, path);
+		hash = hash_bytes(hash, &st.st_size, sizeof(st.st_size));
+		hash = hash_bytes(hash, &st.st_mtim, sizeof(st.st_mtim));
+	}
+
+	hash = hash_bytes(hash, &(int) {BUILD_VERSION}, sizeof(int));
+	strlist_free(&words);
+	return hash;
+}
+
+void objstate_add_input(struct objstate *state, char *path)
+{
+	add_input_mtime(state, path, file_mtime(path));
+}
+
+int objstate_read_depfile(struct objstate *state, char *path, int64_t since)
+{
+	char *buf, *p, *dep;
+	bool changed = false;
+	size_t nknown;
+	int64_t mtime;
+	size_t len;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return 1;
+
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	rewind(f);
+
+	buf = malloc(len + 1);
+	len = fread(buf, 1, len, f);
+	buf[len] = 0;
+	fclose(f);
+
+	/* The depfile is a make rule: "obj.o: src.c a.h \<newline> b.h". Skip
+	   the target, then collect the words. Spaces in paths are escaped with
+	   a backslash, any other backslash is a line continuation. */
+
+	p = strstr(buf, ": ");
+	if (!p)
+		p = strchr(buf, ':');
+	p = p ? p + 1 : buf + len;
+
+	nknown = state->inputs.size;
+	dep = malloc(len + 1);
+	while (*p) {
+		while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'
+				|| (*p == '\\' && (p[1] == '\n' || p[1] == '\r')))
+			p++;
+		if (!*p)
+			break;
+
+		len = 0;
+		while (*p && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') {
+			if (*p == '\\' && p[1] == ' ')
+				p++;
+			else if (*p == '\\' && (p[1] == '\n' || p[1] == '\r'))
+				break;
+			dep[len++] = *p++;
+		}
+
+		/* The compiler lists every file once, but the source itself is
+		   already an input. */
+		dep[len] = 0;
+		if (!len || is_known_input(state, nknown, dep))
+			continue;
+
+		/* The compiler may have read a header before or after it changed,
+		   so the object has to be built again either way. */
+		mtime = file_mtime(dep);
+		if (mtime >= since) {
+			mtime = MTIME_CHANGED;
+			changed = true;
+		}
+		add_input_mtime(state, dep, mtime);
+	}
+
+	free(dep);
+	free(buf);
+	return changed ? -1 : 0;
+}
+
+int objstate_load(struct objstate *state, char *path)
+{
+	char buf[LINESIZE], *p;
+	int64_t mtime;
+	FILE *f;
+	int ver;
+
+	memset(state, 0, sizeof(*state));
+	f = fopen(path, "r");
+	if (!f)
+		return 1;
+
+	/* The state file is always written by the same version of build, so an
+	   older file is treated as missing. */
+	if (fscanf(f, "v %d\n", &ver) != 1 || ver != BUILD_VERSION)
+		goto fail;
+
+	while (fgets(buf, LINESIZE, f)) {
+		buf[linelen(buf)] = 0;
+
+		if (!strncmp(buf, "cmd ", 4)) {
+			state->cmdhash = strtoull(buf + 4, NULL, 16);
+		} else if (!strncmp(buf, "cc ", 3)) {
+			state->cchash = strtoull(buf + 3, NULL, 16);
+		} else if (!strncmp(buf, "time ", 5)) {
+			state->time = strtod(buf + 5, NULL);
+		} else if (!strncmp(buf, "rss ", 4)) {
+			state->rss = strtol(buf + 4, NULL, 10);
+		} else if (!strncmp(buf, "obj ", 4)) {
+			state->objhash = strtoull(buf + 4, &p, 16);
+			state->objmtime = strtoll(p, NULL, 10);
+		} else if (!strncmp(buf, "in ", 3)) {
+			mtime = strtoll(buf + 3, &p, 10);
+			if (*p++ != ' ')
+				goto fail;
+			add_input_mtime(state, p, mtime);
+		}
+	}
+
+	fclose(f);
+	return 0;
+
+fail:
+	fclose(f);
+	objstate_free(state);
+	return 1;
+}
+
+int objstate_save(struct objstate *state, char *path)
+{
+	FILE *f;
+
+	f = fopen(path, "w");
+	if (!f)
+		return 1;
+
+	fprintf(f, "v %d\n", BUILD_VERSION);
+	fprintf(f, "cmd %016llx\n", (unsigned long long) state->cmdhash);
+	fprintf(f, "cc %016llx\n", (unsigned long long) state->cchash);
+	fprintf(f, "time %.3f\n", state->time);
+	fprintf(f, "rss %ld\n", state->rss);
+	if (state->objhash) {
+		fprintf(f, "obj %016llx %lld\n", (unsigned long long) state->objhash,
+				(long long) state->objmtime);
+	}
+	for (size_t i = 0; i < state->inputs.size; i++) {
+		fprintf(f, "in %lld %s\n", (long long) state->mtimes[i],
+				state->inputs.strs[i]);
+	}
+
+	return fclose(f);
+}
+
+bool objstate_set_output(struct objstate *state, char *path,
+		uint64_t oldhash, int64_t oldmtime)
+{
+	struct timespec times[2];
+
+	state->objhash = HASH_INIT;
+	if (hash_file(&state->objhash, path)) {
+		state->objhash = 0;
+		return false;
+	}
+
+	/* Early cutoff: a recompile producing the same bytes, for example after
+	   touching a header or editing a comment, keeps the old mtime. */
+	if (oldhash && oldhash == state->objhash && !unshare_file(path)) {
+		times[0] = (struct timespec) { .tv_nsec = UTIME_OMIT };
+		times[1] = (struct timespec) {
+			.tv_sec = oldmtime / 1000000000,
+			.tv_nsec = oldmtime % 1000000000
+		};
+
+		if (!utimensat(AT_FDCWD, path, times, 0)) {
+			state->objmtime = oldmtime;
+			return true;
+		}
+	}
+
+	state->objmtime = file_mtime(path);
+	return false;
+}
+
+bool objstate_dirty(struct objstate *state, uint64_t cmdhash,
+		uint64_t cchash)
+{
+	if (state->cmdhash != cmdhash || state->cchash != cchash)
+		return true;
+
+	/* Compare the recorded mtimes for equality instead of comparing them
+	   against the object, so checking out an older file also rebuilds. */
+	for (size_t i = 0; i < state->inputs.size; i++) {
+		if (file_mtime(state->inputs.strs[i]) != state->mtimes[i])
+			return true;
+	}
+
+	return !state->inputs.size;
+}
+
+void objstate_free(struct objstate *state)
+{
+	strlist_free(&state->inputs);
+	free(state->mtimes);
+	memset(state, 0, sizeof(*state));
+}
+
+static int unshare_file(char *path)
+{
+	struct stat st;
+	char *tmp;
+	int ret;
+
+	if (stat(path, &st) || st.st_nlink < 2)
+		return 0;
+
+	/* The other link is usually the cache entry, which would look unused
+	   with the old mtime and get evicted first. */
+	tmp = malloc(strlen(path) + 5);
+	sprintf(tmp, "%s.tmp", path);
+	ret = copy_file(path, tmp) || rename(tmp, path);
+	if (ret)
+		unlink(tmp);
+
+	free(tmp);
+	return ret;
+}
+
+static bool find_in_path(char *name, char *buf, size_t size)
+{
+	char *path, *dir, *saveptr;
+	bool found = false;
+
+	if (strchr(name, '/')) {
+		snprintf(buf, size, "%s", name);
+		return true;
+	}
+
+	if (!getenv("PATH"))
+		return false;
+
+	path = strdup(getenv("PATH"));
+	for (dir = strtok_r(path, ":", &saveptr); dir;
+			dir = strtok_r(NULL, ":", &saveptr)) {
+		snprintf(buf, size, "%s/%s", dir, name);
+		if (!access(buf, X_OK)) {
+			found = true;
+			break;
+		}
+	}
+
+	free(path);
+	return found;
+}
+
+static int64_t stat_mtime(char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st) == -1)
+		return -1;
+	return (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+static void add_input_mtime(struct objstate *state, char *path,
+		int64_t mtime)
+{
+	size_t space = state->inputs.space;
+
+	/* The mtimes grow with the space of the list. */
+	strlist_append(&state->inputs, path);
+	if (state->inputs.space != space || !state->mtimes) {
+		state->mtimes = realloc(state->mtimes, sizeof(int64_t)
+				* state->inputs.space);
+	}
+
+	state->mtimes[state->inputs.size - 1] = mtime;
+}
+
+static bool is_known_input(struct objstate *state, size_t n, char *path)
+{
+	for (size_t i = 0; i < n; i++) {
+		if (!strcmp(state->inputs.strs[i], path))
+			return true;
+	}
+
+	return false;
+}
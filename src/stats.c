@@ -0,0 +1,158 @@
+/*
+ * stats.c - phase timers & counters for --stats
+ * Copyright (c) 2022 mini-rose
+ */
+
+#include "build.h"
+
+
+/* The phases are timed from the same spans as the trace, which are taken
+   with or without it, so --stats adds no clock reads of its own. When it is
+   off, a span costs a single check, and a counter an addition. */
+
+struct phase
+{
+	const char *name;
+	size_t count;
+	double total;
+	double max;
+};
+
+static struct phase phases[] = {
+	{ .name = "resolve_buildpath" },
+	{ .name = "parse_buildfile" },
+	{ .name = "expand_wildcards" },
+	{ .name = "remove_excluded" },
+	{ .name = "check" },
+	{ .name = "pch" },
+	{ .name = "preprocess" },
+	{ .name = "compile" },
+	{ .name = "cached" },
+	{ .name = "archive" },
+	{ .name = "link" },
+	{ .name = "target" }
+};
+
+#define NPHASES     (sizeof(phases) / sizeof(*phases))
+
+static const char *counter_names[STAT_NCOUNTERS] = {
+	[STAT_SPAWNED]  = "processes",
+	[STAT_CMDBYTES] = "cmdline_bytes",
+	[STAT_ALLOCS]   = "strlist_allocs"
+};
+
+static const char *counter_titles[STAT_NCOUNTERS] = {
+	[STAT_SPAWNED]  = "processes spawned",
+	[STAT_CMDBYTES] = "command line bytes",
+	[STAT_ALLOCS]   = "strlist allocations"
+};
+
+static struct
+{
+	bool enabled;
+	bool json;
+	double t0;
+	size_t counters[STAT_NCOUNTERS];
+} stats;
+
+static void print_table(double wall);
+static void print_json(double wall);
+
+
+void stats_open(bool json)
+{
+	stats.enabled = true;
+	stats.json = json;
+	stats.t0 = clock_now();
+}
+
+bool stats_enabled(void)
+{
+	return stats.enabled;
+}
+
+void stats_span(const char *name, const char *cat, double start, double end)
+{
+	struct phase *p;
+
+	if (!stats.enabled)
+		return;
+
+	if (strcmp(cat, "setup"))
+		name = cat;
+
+	for (size_t i = 0; i < NPHASES; i++) {
+		p = &phases[i];
+		if (strcmp(p->name, name))
+			continue;
+		p->count++;
+		p->total += end - start;
+		if (end - start > p->max)
+			p->max = end - start;
+		return;
+	}
+}
+
+void stats_count(enum stat_counter counter, size_t n)
+{
+	stats.counters[counter] += n;
+}
+
+void stats_close(void)
+{
+	double wall;
+
+	if (!stats.enabled)
+		return;
+
+	wall = clock_now() - stats.t0;
+	if (stats.json)
+		print_json(wall);
+	else
+		print_table(wall);
+
+	fflush(stdout);
+	stats.enabled = false;
+}
+
+static void print_table(double wall)
+{
+	struct phase *p;
+
+	puts("stats:");
+	printf("  %-20s %8s %12s %12s\n", "phase", "count", "total ms",
+			"max ms");
+	for (size_t i = 0; i < NPHASES; i++) {
+		p = &phases[i];
+		if (!p->count)
+			continue;
+		printf("  %-20s %8zu %12.3f %12.3f\n", p->name, p->count,
+				p->total * 1000, p->max * 1000);
+	}
+
+	printf("  %-20s %8s %12.3f\n", "wall", "", wall * 1000);
+	for (int i = 0; i < STAT_NCOUNTERS; i++)
+		printf("  %-29s %12zu\n", counter_titles[i], stats.counters[i]);
+}
+
+static void print_json(double wall)
+{
+	struct phase *p;
+	bool first = true;
+
+	printf("{\"wall_ms\":%.3f,\"phases\":{", wall * 1000);
+	for (size_t i = 0; i < NPHASES; i++) {
+		p = &phases[i];
+		if (!p->count)
+			continue;
+		printf("%s\"%s\":{\"count\":%zu,\"total_ms\":%.3f,\"max_ms\":%.3f}",
+				first ? "" : ",", p->name, p->count, p->total * 1000,
+				p->max * 1000);
+		first = false;
+	}
+
+	putchar('}');
+	for (int i = 0; i < STAT_NCOUNTERS; i++)
+		printf(",\"%s\":%zu", counter_names[i], stats.counters[i]);
+	puts("}");
+}
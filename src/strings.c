@@ -4,6 +4,9 @@
  */
 
 #include "build.h"
+#include <stdarg.h>
+
+static void strlist_reserve(struct strlist *list);
 
 
 size_t wordlen(char *word)
@@ -32,15 +35,35 @@ size_t linelen(char *line)
 
 char *strlist_append(struct strlist *list, char *str)
 {
-	if (list->size >= list->space) {
-		list->space += STRLIST_GRAN;
-		list->strs = realloc(list->strs, sizeof(char *) * list->space);
-	}
+	strlist_reserve(list);
+	stats_count(STAT_ALLOCS, 1);
 
 	list->strs[list->size] = strdup(str);
 	return list->strs[list->size++];
 }
 
+char *strlist_appendf(struct strlist *list, const char *fmt, ...)
+{
+	va_list args;
+	char *str;
+	int len;
+
+	va_start(args, fmt);
+	len = vsnprintf(NULL, 0, fmt, args);
+	va_end(args);
+
+	str = malloc(len + 1);
+	stats_count(STAT_ALLOCS, 1);
+	va_start(args, fmt);
+	vsnprintf(str, len + 1, fmt, args);
+	va_end(args);
+
+	strlist_reserve(list);
+
+	list->strs[list->size++] = str;
+	return str;
+}
+
 void strlist_free(struct strlist *list)
 {
 	for (size_t i = 0; i < list->size; i++)
@@ -50,6 +73,38 @@ void strlist_free(struct strlist *list)
 	memset(list, 0, sizeof(*list));
 }
 
+char **strlist_terminate(struct strlist *list)
+{
+	strlist_reserve(list);
+
+	list->strs[list->size] = NULL;
+	return list->strs;
+}
+
+char *strlist_join(struct strlist *list, char *sep)
+{
+	size_t len = 1, seplen = strlen(sep), offset = 0, n;
+	char *str;
+
+	for (size_t i = 0; i < list->size; i++)
+		len += strlen(list->strs[i]) + seplen;
+
+	str = malloc(len);
+	stats_count(STAT_ALLOCS, 1);
+	str[0] = 0;
+	for (size_t i = 0; i < list->size; i++) {
+		if (i) {
+			memcpy(str + offset, sep, seplen);
+			offset += seplen;
+		}
+		n = strlen(list->strs[i]);
+		memcpy(str + offset, list->strs[i], n + 1);
+		offset += n;
+	}
+
+	return str;
+}
+
 size_t strlist_find(struct strlist *list, char *str)
 {
 	for (size_t i = 0; i < list->size; i++) {
@@ -132,7 +187,38 @@ int strreplace(char *str, char from, char to)
 	return replaced;
 }
 
+long long parse_size(char *str)
+{
+	long long size;
+	char *end;
+
+	size = strtoll(str, &end, 10);
+	switch (*end) {
+		case 'k': case 'K':
+			return size << 10;
+		case 'm': case 'M':
+			return size << 20;
+		case 'g': case 'G':
+			return size << 30;
+		case 't': case 'T':
+			return size << 40;
+	}
+
+	return size;
+}
+
 bool iswhitespace(char c)
 {
 	return c == ' ' || c == '\t';
 }
+
+static void strlist_reserve(struct strlist *list)
+{
+	/* Double the space, so a list of the objects of a big project is not
+	   copied on every few appends. */
+	if (list->size >= list->space) {
+		list->space = list->space ? list->space * 2 : STRLIST_GRAN;
+		list->strs = realloc(list->strs, sizeof(char *) * list->space);
+		stats_count(STAT_ALLOCS, 1);
+	}
+}
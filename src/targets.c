@@ -0,0 +1,232 @@
+/*
+ * targets.c - running targets with their prerequisites
+ * Copyright (c) 2022 mini-rose
+ */
+
+#include "build.h"
+
+
+/* The called targets & everything they need form a graph, which is put in
+   an order where every target comes after the ones it needs, and then run
+   from the job queue. A target is ready once all of its prerequisites are
+   done, so the independent ones run at the same time, in the job slots of
+   the build. The compile step is a node of the graph too; it runs the
+   compilers from its own queue, while the targets started before it keep
+   running in their slots. */
+
+#define COMPILE_NAME    "compile"
+
+struct node
+{
+	char *name;
+	size_t target;                  /* index, or INVALID_INDEX for compile */
+	size_t *needs;                  /* indices into ctx->nodes */
+	size_t nneeds;
+	char *command;
+	bool failed;
+	bool done;
+};
+
+struct targets_ctx
+{
+	struct config *config;
+	struct node *nodes;
+	size_t nnodes;
+	char *marks;                    /* 1 while visiting, 2 when added */
+	size_t *index;                  /* target (or compile) -> node */
+	int failed;
+};
+
+/* Add the node for `name` after all nodes it needs. Returns the index of
+   the node, or INVALID_INDEX on an error. */
+static size_t add_node(struct targets_ctx *ctx, char *name, char *neededby);
+
+static pid_t start_target(struct jobqueue *queue, size_t job, int slot);
+static void finish_target(struct jobqueue *queue, size_t job,
+		struct proc_result *res);
+static int ready_target(struct jobqueue *queue, size_t job);
+
+
+int targets_run(struct config *config, struct strlist *names)
+{
+	struct targets_ctx ctx = { .config = config };
+	struct jobqueue queue;
+	size_t n = config->ntargets + 1;
+
+	ctx.nodes = calloc(n, sizeof(*ctx.nodes));
+	ctx.marks = calloc(n, 1);
+	ctx.index = malloc(n * sizeof(*ctx.index));
+
+	for (size_t i = 0; i < names->size; i++) {
+		if (add_node(&ctx, names->strs[i], NULL) == INVALID_INDEX) {
+			ctx.failed = -1;
+			goto end;
+		}
+	}
+
+	queue = (struct jobqueue) {
+		.njobs = ctx.nnodes,
+		.nslots = config->njobs > 0 ? config->njobs : 1,
+		.data = &ctx,
+		.start = start_target,
+		.finish = finish_target,
+		.ready = ready_target
+	};
+
+	jobs_run(&queue);
+
+end:
+	for (size_t i = 0; i < ctx.nnodes; i++) {
+		free(ctx.nodes[i].needs);
+		free(ctx.nodes[i].command);
+	}
+
+	free(ctx.nodes);
+	free(ctx.marks);
+	free(ctx.index);
+	return ctx.failed;
+}
+
+static size_t add_node(struct targets_ctx *ctx, char *name, char *neededby)
+{
+	struct config *config = ctx->config;
+	struct target *target = NULL;
+	size_t index, slot, need, nneeds, *needs;
+	struct node *node;
+
+	index = config_find_target(config, name);
+	if (index == INVALID_INDEX && strcmp(name, COMPILE_NAME)) {
+		if (neededby) {
+			fprintf(stderr, "build: target %s needs an unknown target %s\n",
+					neededby, name);
+		} else {
+			fprintf(stderr, "build: %s is not a target\n", name);
+		}
+		return INVALID_INDEX;
+	}
+
+	/* The compile step takes the slot after the targets. */
+	slot = index == INVALID_INDEX ? config->ntargets : index;
+	if (ctx->marks[slot] == 2)
+		return ctx->index[slot];
+	if (ctx->marks[slot] == 1) {
+		fprintf(stderr, "build: target %s needs itself\n", name);
+		return INVALID_INDEX;
+	}
+
+	ctx->marks[slot] = 1;
+	if (index != INVALID_INDEX)
+		target = config->targets[index];
+
+	/* The node is added after its prerequisites, so the order of the queue
+	   is already a valid order to run them in. */
+	nneeds = target ? target->needs.size : 0;
+	needs = calloc(nneeds + 1, sizeof(*needs));
+	for (size_t i = 0; i < nneeds; i++) {
+		need = add_node(ctx, target->needs.strs[i], name);
+		if (need == INVALID_INDEX) {
+			free(needs);
+			return INVALID_INDEX;
+		}
+		needs[i] = need;
+	}
+
+	node = &ctx->nodes[ctx->nnodes];
+	*node = (struct node) {
+		.name = target ? target->name : COMPILE_NAME,
+		.target = index,
+		.needs = needs,
+		.nneeds = nneeds,
+		.command = target ? config_target_command(config, index) : NULL
+	};
+
+	ctx->marks[slot] = 2;
+	ctx->index[slot] = ctx->nnodes;
+	return ctx->nnodes++;
+}
+
+static pid_t start_target(struct jobqueue *queue, size_t job, int slot)
+{
+	struct targets_ctx *ctx = queue->data;
+	struct node *node = &ctx->nodes[job];
+	pid_t pid;
+
+	(void) slot;
+
+	/* Compiling runs its own queue, so it blocks this one. The targets
+	   which are already running keep going, and are reaped once it is
+	   done. */
+	if (node->target == INVALID_INDEX) {
+		if (ctx->config->only_setup || (!ctx->config->sources.size
+					&& !ctx->config->nartifacts)) {
+			node->done = true;
+		} else if (compile(ctx->config)) {
+			node->failed = true;
+			ctx->failed++;
+		} else {
+			node->done = true;
+		}
+		return 0;
+	}
+
+	/* A target only listing others is done right away. */
+	if (!*node->command) {
+		node->done = true;
+		return 0;
+	}
+
+	if (ctx->config->explain)
+		printf("issuing '%s'\n", node->command);
+
+	/* Don't let the target's output overtake ours. */
+	fflush(stdout);
+	pid = spawn_shell(node->command, NULL);
+	if (pid == -1) {
+		fprintf(stderr, "build: cannot run target %s\n", node->name);
+		node->failed = true;
+		ctx->failed++;
+	}
+
+	return pid;
+}
+
+static void finish_target(struct jobqueue *queue, size_t job,
+		struct proc_result *res)
+{
+	struct targets_ctx *ctx = queue->data;
+	struct node *node = &ctx->nodes[job];
+
+	trace_span(node->name, "target", res->slot + 1, res->start,
+			res->start + res->wall);
+
+	if (res->status) {
+		fprintf(stderr, "build: target %s failed (status %d)\n", node->name,
+				res->status);
+		node->failed = true;
+		ctx->failed++;
+		return;
+	}
+
+	node->done = true;
+}
+
+static int ready_target(struct jobqueue *queue, size_t job)
+{
+	struct targets_ctx *ctx = queue->data;
+	struct node *node = &ctx->nodes[job], *need;
+
+	for (size_t i = 0; i < node->nneeds; i++) {
+		need = &ctx->nodes[node->needs[i]];
+		if (need->failed) {
+			fprintf(stderr, "build: skipping %s, as %s failed\n", node->name,
+					need->name);
+			node->failed = true;
+			ctx->failed++;
+			return -1;
+		}
+		if (!need->done)
+			return 0;
+	}
+
+	return 1;
+}
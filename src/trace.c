@@ -0,0 +1,211 @@
+/*
+ * trace.c - build trace in the Chrome trace event format
+ * Copyright (c) 2022 mini-rose
+ */
+
+#include "build.h"
+
+
+/* The spans are kept in memory and written in trace_close(). The resulting
+   JSON file can be opened in chrome://tracing or ui.perfetto.dev. Thread 0
+   is the main thread, each job slot gets its own thread starting from 1. */
+
+struct span
+{
+	char *name;
+	const char *cat;
+	int tid;
+	double start;
+	double end;
+};
+
+static struct
+{
+	char *path;
+	double t0;
+	struct span *spans;
+	size_t nspans;
+	size_t space;
+	int nslots;
+} trace;
+
+static void write_escaped(FILE *f, const char *str);
+static void print_summary(void);
+static int cmp_span_start(const void *a, const void *b);
+
+
+void trace_open(char *path)
+{
+	free(trace.path);
+	trace.path = strdup(path);
+	trace.t0 = clock_now();
+}
+
+bool trace_enabled(void)
+{
+	return trace.path != NULL;
+}
+
+void trace_span(const char *name, const char *cat, int tid, double start,
+		double end)
+{
+	stats_span(name, cat, start, end);
+	if (!trace.path)
+		return;
+
+	if (trace.nspans >= trace.space) {
+		trace.space = trace.space ? trace.space * 2 : 256;
+		trace.spans = realloc(trace.spans, sizeof(*trace.spans)
+				* trace.space);
+	}
+
+	trace.spans[trace.nspans++] = (struct span) {
+		.name = strdup(name),
+		.cat = cat,
+		.tid = tid,
+		.start = start,
+		.end = end
+	};
+
+	if (tid > trace.nslots)
+		trace.nslots = tid;
+}
+
+void trace_close(void)
+{
+	struct span *s;
+	FILE *f;
+
+	if (!trace.path)
+		return;
+
+	f = fopen(trace.path, "w");
+	if (!f) {
+		fprintf(stderr, "build: cannot write trace to %s\n", trace.path);
+		goto end;
+	}
+
+	fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", f);
+	fputs("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,"
+			"\"args\":{\"name\":\"build\"}}", f);
+	for (int i = 1; i <= trace.nslots; i++) {
+		fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+				"\"tid\":%d,\"args\":{\"name\":\"slot %d\"}}", i, i);
+	}
+
+	for (size_t i = 0; i < trace.nspans; i++) {
+		s = &trace.spans[i];
+		fputs(",\n{\"name\":\"", f);
+		write_escaped(f, s->name);
+		fprintf(f, "\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+				"\"ts\":%.0f,\"dur\":%.0f}", s->cat, s->tid,
+				(s->start - trace.t0) * 1e6, (s->end - s->start) * 1e6);
+	}
+
+	fputs("\n]}\n", f);
+	fclose(f);
+
+	print_summary();
+
+end:
+	for (size_t i = 0; i < trace.nspans; i++)
+		free(trace.spans[i].name);
+	free(trace.spans);
+	free(trace.path);
+	memset(&trace, 0, sizeof(trace));
+}
+
+static void write_escaped(FILE *f, const char *str)
+{
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			fprintf(f, "\\%c", *str);
+		else if ((unsigned char) *str < 0x20)
+			fprintf(f, "\\u%04x", *str);
+		else
+			fputc(*str, f);
+	}
+}
+
+static void print_summary(void)
+{
+	double first = 0, last = 0, busy = 0, wall;
+	struct span *s, *cur, **path;
+	size_t npath, njobs = 0;
+
+	/* Average parallelism & idle time of the job slots. */
+
+	for (size_t i = 0; i < trace.nspans; i++) {
+		s = &trace.spans[i];
+		if (!s->tid)
+			continue;
+		if (!njobs++ || s->start < first)
+			first = s->start;
+		if (s->end > last)
+			last = s->end;
+		busy += s->end - s->start;
+	}
+
+	wall = last - first;
+	puts("trace summary:");
+	if (njobs) {
+		printf("  jobs:                %zu on %d slots\n", njobs,
+				trace.nslots);
+		printf("  job stage:           %.3fs\n", wall);
+		printf("  average parallelism: %.2f\n", wall > 0 ? busy / wall : 0);
+		printf("  slot idle time:      %.3fs (%.1f%%)\n",
+				wall * trace.nslots - busy, wall > 0 ? 100 * (1 - busy
+					/ (wall * trace.nslots)) : 0);
+	}
+
+	/* The critical path: start with the span which ended last, and keep
+	   going back to the span that ended last before it started. A job
+	   started because the previous job in its slot finished, so that one
+	   is preferred. Spans enclosing the current one, like the wildcards
+	   inside the buildfile, are skipped because they end after it. */
+
+	if (!trace.nspans)
+		return;
+
+	path = malloc(sizeof(*path) * trace.nspans);
+	npath = 0;
+
+	cur = &trace.spans[0];
+	for (size_t i = 1; i < trace.nspans; i++) {
+		if (trace.spans[i].end > cur->end)
+			cur = &trace.spans[i];
+	}
+
+	while (cur) {
+		path[npath++] = cur;
+		s = NULL;
+		for (size_t i = 0; i < trace.nspans; i++) {
+			if (trace.spans[i].end > cur->start + 1e-6)
+				continue;
+			if (s && cur->tid && s->tid == cur->tid
+					&& trace.spans[i].tid != cur->tid)
+				continue;
+			if (!s || trace.spans[i].end > s->end
+					|| (cur->tid && trace.spans[i].tid == cur->tid
+						&& s->tid != cur->tid))
+				s = &trace.spans[i];
+		}
+		cur = s;
+	}
+
+	qsort(path, npath, sizeof(*path), cmp_span_start);
+	printf("  critical path:       %.3fs\n", path[npath - 1]->end
+			- path[0]->start);
+	for (size_t i = 0; i < npath; i++) {
+		printf("    %8.3fs  %-8s %s\n", path[i]->end - path[i]->start,
+				path[i]->cat, path[i]->name);
+	}
+
+	free(path);
+}
+
+static int cmp_span_start(const void *a, const void *b)
+{
+	const struct span *sa = * (struct span **) a, *sb = * (struct span **) b;
+	return (sa->start > sb->start) - (sa->start < sb->start);
+}
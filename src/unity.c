@@ -0,0 +1,238 @@
+/*
+ * unity.c - unity builds, compiling sources in batches
+ * Copyright (c) 2022 mini-rose
+ */
+
+#include "build.h"
+#include <fnmatch.h>
+#include <dirent.h>
+
+
+/* In unity mode, the sources are joined into batches, which are generated
+   sources including the real ones, so shared headers are only parsed once
+   per batch instead of once per source.
+
+   The sources are split into batches in sorted order. Where a batch ends is
+   decided by the hash of the source path, once the batch is big enough, so
+   adding, removing or editing a source only changes its own batch, and
+   maybe the next one. Batches are named after their first source and only
+   written if they changed, so the others stay up to date. */
+
+#define UNITY_PREFIX    "unity-"
+
+static bool is_excluded(struct config *config, char *source);
+static bool write_batch(char *path, struct strlist *sources);
+static void remove_stale(struct config *config, struct strlist *batches);
+static uint64_t round_pow2(uint64_t n);
+static uint64_t round_coarse(uint64_t n);
+static int cmp_str(const void *a, const void *b);
+
+
+void unity_prepare(struct config *config)
+{
+	struct strlist sorted = {0}, batch = {0}, batches = {0}, result = {0};
+	uint64_t period, target, least, weight, left, total = 0, *weights;
+	char *path, *real;
+	struct stat st;
+	bool match;
+	int nbatches;
+	size_t len;
+
+	if (!config->unity)
+		return;
+
+	/* "on" means one batch for every job slot. */
+	nbatches = atoi(config->unity);
+	if (!strcmp(config->unity, "on"))
+		nbatches = config->njobs;
+	if (nbatches <= 0)
+		return;
+
+	for (size_t i = 0; i < config->sources.size; i++) {
+		/* Don't put old batches into batches. */
+		if (config_in_builddir(config, config->sources.strs[i]))
+			continue;
+
+		if (is_excluded(config, config->sources.strs[i]))
+			strlist_append(&result, config->sources.strs[i]);
+		else
+			strlist_append(&sorted, config->sources.strs[i]);
+	}
+
+	qsort(sorted.strs, sorted.size, sizeof(char *), cmp_str);
+
+	/* The size of a source is a good enough guess for its compile time,
+	   without reading it. The target size of a batch and the average
+	   amount of sources in it are rounded, so they don't change every time
+	   a source is edited. */
+
+	weights = malloc(sizeof(*weights) * (sorted.size + 1));
+	for (size_t i = 0; i < sorted.size; i++) {
+		weights[i] = stat(sorted.strs[i], &st) ? 1 : st.st_size + 1;
+		total += weights[i];
+	}
+
+	/* A batch ends at the first source with a matching hash, after it
+	   reached the least size. Which is `period` average sources short of the
+	   target, the sources it takes on average to find a match, so batches end
+	   at the target on average, and there are about `nbatches`. With the
+	   period at a quarter batch, they don't vary much. Less than half a batch
+	   left at the end goes into the last one. */
+	target = round_coarse(total / nbatches);
+	period = round_pow2(sorted.size / nbatches / 4);
+	least = sorted.size ? period * (total / sorted.size) : 0;
+	least = least < target ? target - least : 0;
+
+	len = strlen(config->builddir) + strlen(UNITY_PREFIX) + 24;
+	weight = 0;
+	left = total;
+
+	for (size_t i = 0; i < sorted.size; i++) {
+		real = realpath(sorted.strs[i], NULL);
+		strlist_append(&batch, real ? real : sorted.strs[i]);
+		free(real);
+		weight += weights[i];
+		left -= weights[i];
+
+		/* The high bits of FNV-1a are mixed better than the low ones. */
+		match = i + 1 < sorted.size && !((hash_str(HASH_INIT,
+						sorted.strs[i + 1]) >> 32) % period);
+		if (i + 1 < sorted.size && weight < target * 2 && (weight < least
+					|| left < target / 2 || !match))
+			continue;
+
+		/* A single source doesn't need a batch. */
+		if (batch.size == 1) {
+			strlist_append(&result, sorted.strs[i]);
+		} else {
+			path = malloc(len);
+			snprintf(path, len, "%s/" UNITY_PREFIX "%016llx.c",
+					config->builddir, (unsigned long long) hash_str(
+						HASH_INIT, batch.strs[0]));
+			write_batch(path, &batch);
+			strlist_append(&result, path);
+			strlist_append(&batches, path);
+			free(path);
+		}
+
+		if (config->explain) {
+			printf("unity batch %s:\n", result.strs[result.size - 1]);
+			for (size_t j = 0; j < batch.size; j++)
+				printf("  %s\n", batch.strs[j]);
+		}
+
+		strlist_free(&batch);
+		weight = 0;
+	}
+
+	remove_stale(config, &batches);
+
+	strlist_free(&config->sources);
+	config->sources = result;
+
+	strlist_free(&batches);
+	strlist_free(&sorted);
+	free(weights);
+}
+
+static bool is_excluded(struct config *config, char *source)
+{
+	for (size_t i = 0; i < config->unityexclude.size; i++) {
+		if (!fnmatch(config->unityexclude.strs[i], source, 0))
+			return true;
+	}
+
+	return false;
+}
+
+static bool write_batch(char *path, struct strlist *sources)
+{
+	char *contents, *cur = NULL;
+	size_t len = 1, curlen;
+	FILE *f;
+
+	/* The paths are absolute, as the batch is in the build directory. */
+	for (size_t i = 0; i < sources->size; i++)
+		len += strlen(sources->strs[i]) + 13;
+
+	contents = malloc(len);
+	contents[0] = 0;
+	for (size_t i = 0; i < sources->size; i++) {
+		strcat(contents, "#include \"");
+		strcat(contents, sources->strs[i]);
+		strcat(contents, "\"\n");
+	}
+
+	/* Keep the mtime, if nothing changed. */
+	f = fopen(path, "r");
+	if (f) {
+		cur = calloc(len + 1, 1);
+		curlen = fread(cur, 1, len, f);
+		fclose(f);
+		if (curlen == strlen(contents) && !strcmp(cur, contents)) {
+			free(contents);
+			free(cur);
+			return true;
+		}
+		free(cur);
+	}
+
+	f = fopen(path, "w");
+	if (!f) {
+		fprintf(stderr, "build: cannot write %s\n", path);
+		free(contents);
+		return false;
+	}
+
+	fputs(contents, f);
+	free(contents);
+	return !fclose(f);
+}
+
+static void remove_stale(struct config *config, struct strlist *batches)
+{
+	struct dirent *ent;
+	char *path;
+	DIR *dir;
+
+	dir = opendir(config->builddir);
+	if (!dir)
+		return;
+
+	while ((ent = readdir(dir))) {
+		if (strncmp(ent->d_name, UNITY_PREFIX, strlen(UNITY_PREFIX)))
+			continue;
+
+		path = malloc(strlen(config->builddir) + strlen(ent->d_name) + 2);
+		sprintf(path, "%s/%s", config->builddir, ent->d_name);
+		if (strlist_find(batches, path) == INVALID_INDEX)
+			unlink(path);
+		free(path);
+	}
+
+	closedir(dir);
+}
+
+static uint64_t round_pow2(uint64_t n)
+{
+	uint64_t pow = 1;
+
+	while (pow * 2 <= n)
+		pow *= 2;
+	return n - pow >= pow / 2 && pow > 1 ? pow * 2 : pow;
+}
+
+static uint64_t round_coarse(uint64_t n)
+{
+	uint64_t step = 1;
+
+	/* Keep 4 significant bits, which is within 1/16 of `n`. */
+	while (step * 16 <= n)
+		step *= 2;
+	return (n + step / 2) / step * step;
+}
+
+static int cmp_str(const void *a, const void *b)
+{
+	return strcmp(* (char **) a, * (char **) b);
+}
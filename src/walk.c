@@ -0,0 +1,403 @@
+/*
+ * walk.c - parallel directory walker
+ * Copyright (c) 2022 mini-rose
+ */
+
+#if __linux__
+/* For syscall() & SYS_getdents64. */
+# define _GNU_SOURCE
+#endif
+
+#include "build.h"
+#include <sys/types.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#if __linux__
+# include <sys/syscall.h>
+#endif
+
+
+/* The walker matches all patterns in a single traversal of each root
+   directory. Directories waiting to be read are kept on a shared stack,
+   from which a couple of threads take them. Because of that, the order in
+   which files are found is random, so the results are sorted in the end. */
+
+#define WALK_MAX_THREADS    16
+#define WALK_BUFSIZ         32768
+
+struct walk_root
+{
+	char *path;
+	struct walk_pattern **patterns;
+	size_t npatterns;
+};
+
+struct walk_state
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct strlist stack;           /* directories left to read */
+	size_t *stack_roots;            /* root index of each directory */
+	int busy;                       /* threads reading a directory */
+	struct walk_root *roots;
+	struct globset *exclude;
+};
+
+/* Where to record the mtime of every directory read, if set. */
+static struct strmap *recorded_dirs;
+
+static void *walk_thread(struct walk_state *state);
+static void record_dir(struct walk_state *state, char *path, int fd);
+static void read_dir(struct walk_state *state, char *path, size_t root);
+static void found_entry(struct walk_state *state, size_t root, char *path,
+		char *name, int type);
+static void push_dir(struct walk_state *state, char *path, size_t root);
+static bool pattern_matches(struct walk_pattern *pattern, struct walk_root *r,
+		char *path, char *name);
+static bool skip_dir(struct walk_state *state, size_t root, char *path);
+static char *normalize_dir(char *dir);
+static bool dir_contains(char *outer, char *inner);
+static int cmp_str(const void *a, const void *b);
+
+
+void walk(struct walk_pattern *patterns, size_t n, struct globset *exclude)
+{
+	struct walk_state state = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+		.exclude = exclude
+	};
+	pthread_t threads[WALK_MAX_THREADS];
+	size_t nroots = 0, r;
+	int nthreads;
+
+	/* Assign each pattern to the outermost directory containing it, so a
+	   directory is never read twice. */
+
+	state.roots = calloc(n, sizeof(*state.roots));
+	for (size_t i = 0; i < n; i++)
+		patterns[i].dir = normalize_dir(patterns[i].dir);
+
+	for (size_t i = 0; i < n; i++) {
+		for (r = 0; r < nroots; r++) {
+			if (dir_contains(state.roots[r].path, patterns[i].dir))
+				break;
+			if (dir_contains(patterns[i].dir, state.roots[r].path)) {
+				state.roots[r].path = patterns[i].dir;
+				break;
+			}
+		}
+
+		if (r == nroots)
+			state.roots[nroots++].path = patterns[i].dir;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		for (r = 0; r < nroots; r++) {
+			if (dir_contains(state.roots[r].path, patterns[i].dir))
+				break;
+		}
+
+		state.roots[r].patterns = realloc(state.roots[r].patterns,
+				sizeof(struct walk_pattern *)
+				* (state.roots[r].npatterns + 1));
+		state.roots[r].patterns[state.roots[r].npatterns++] = &patterns[i];
+	}
+
+	for (r = 0; r < nroots; r++)
+		push_dir(&state, state.roots[r].path, r);
+
+	nthreads = get_nprocs();
+	if (nthreads > WALK_MAX_THREADS)
+		nthreads = WALK_MAX_THREADS;
+
+	/* The main thread works too, so start one less. */
+	for (int i = 0; i < nthreads - 1; i++) {
+		if (pthread_create(&threads[i], NULL, (void *(*)(void *)) walk_thread,
+					&state)) {
+			nthreads = i + 1;
+			break;
+		}
+	}
+
+	walk_thread(&state);
+	for (int i = 0; i < nthreads - 1; i++)
+		pthread_join(threads[i], NULL);
+
+	for (size_t i = 0; i < n; i++) {
+		qsort(patterns[i].results.strs, patterns[i].results.size,
+				sizeof(char *), cmp_str);
+	}
+
+	for (r = 0; r < nroots; r++)
+		free(state.roots[r].patterns);
+	free(state.roots);
+	free(state.stack_roots);
+	strlist_free(&state.stack);
+}
+
+void walk_record(struct strmap *dirs)
+{
+	recorded_dirs = dirs;
+}
+
+void walk_pattern_free(struct walk_pattern *pattern)
+{
+	strlist_free(&pattern->results);
+	free(pattern->dir);
+	free(pattern->name);
+	if (pattern->glob) {
+		glob_free(pattern->glob);
+		free(pattern->glob);
+	}
+}
+
+static void *walk_thread(struct walk_state *state)
+{
+	char *path;
+	size_t root;
+
+	pthread_mutex_lock(&state->lock);
+	while (1) {
+		while (!state->stack.size && state->busy)
+			pthread_cond_wait(&state->cond, &state->lock);
+
+		/* Nothing left to read, and nobody can add more. */
+		if (!state->stack.size)
+			break;
+
+		path = state->stack.strs[--state->stack.size];
+		root = state->stack_roots[state->stack.size];
+		state->busy++;
+		pthread_mutex_unlock(&state->lock);
+
+		read_dir(state, path, root);
+		free(path);
+
+		pthread_mutex_lock(&state->lock);
+		state->busy--;
+		if (!state->busy && !state->stack.size)
+			pthread_cond_broadcast(&state->cond);
+	}
+
+	pthread_mutex_unlock(&state->lock);
+	return NULL;
+}
+
+static void record_dir(struct walk_state *state, char *path, int fd)
+{
+	struct stat st;
+
+	if (!recorded_dirs || fstat(fd, &st) == -1)
+		return;
+
+	/* Taken before reading it, so a change while reading is noticed. */
+	pthread_mutex_lock(&state->lock);
+	strmap_set(recorded_dirs, path, (int64_t) st.st_mtim.tv_sec * 1000000000
+			+ st.st_mtim.tv_nsec);
+	pthread_mutex_unlock(&state->lock);
+}
+
+#if __linux__
+
+struct linux_dirent64
+{
+	ino64_t d_ino;
+	off64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+static void read_dir(struct walk_state *state, char *path, size_t root)
+{
+	struct linux_dirent64 *ent;
+	char *buf;
+	long n;
+	int fd;
+
+	fd = openat(AT_FDCWD, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		if (!strcmp(path, state->roots[root].path))
+			fprintf(stderr, "build: cannot open %s\n", path);
+		return;
+	}
+
+	record_dir(state, path, fd);
+
+	/* Read the entries in big chunks, instead of one by one. */
+	buf = malloc(WALK_BUFSIZ);
+	while ((n = syscall(SYS_getdents64, fd, buf, WALK_BUFSIZ)) > 0) {
+		for (long off = 0; off < n; off += ent->d_reclen) {
+			ent = (struct linux_dirent64 *) (buf + off);
+			found_entry(state, root, path, ent->d_name, ent->d_type);
+		}
+	}
+
+	free(buf);
+	close(fd);
+}
+
+#else
+
+static void read_dir(struct walk_state *state, char *path, size_t root)
+{
+	struct dirent *ent;
+	DIR *dir;
+	int fd;
+
+	fd = openat(AT_FDCWD, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1 || !(dir = fdopendir(fd))) {
+		if (fd != -1)
+			close(fd);
+		if (!strcmp(path, state->roots[root].path))
+			fprintf(stderr, "build: cannot open %s\n", path);
+		return;
+	}
+
+	record_dir(state, path, fd);
+	while ((ent = readdir(dir)))
+		found_entry(state, root, path, ent->d_name, ent->d_type);
+
+	closedir(dir);
+}
+
+#endif
+
+static void found_entry(struct walk_state *state, size_t root, char *path,
+		char *name, int type)
+{
+	struct walk_root *r = &state->roots[root];
+	struct walk_pattern *pattern;
+	char *full;
+	struct stat st;
+
+	if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+		return;
+
+	/* Paths in the current directory don't get a "./" prefix. */
+	if (strcmp(path, ".")) {
+		full = malloc(strlen(path) + strlen(name) + 2);
+		sprintf(full, "%s/%s", path, name);
+	} else {
+		full = strdup(name);
+	}
+
+	/* Some filesystems don't fill in d_type. Symlinks are not followed,
+	   just like find does by default. */
+	if (type == DT_UNKNOWN) {
+		type = DT_LNK;
+		if (!lstat(full, &st)) {
+			if (S_ISDIR(st.st_mode))
+				type = DT_DIR;
+			else if (S_ISREG(st.st_mode))
+				type = DT_REG;
+		}
+	}
+
+	if (type == DT_DIR) {
+		if (!skip_dir(state, root, full))
+			push_dir(state, full, root);
+	} else if (type == DT_REG) {
+		for (size_t i = 0; i < r->npatterns; i++) {
+			pattern = r->patterns[i];
+			if (!pattern_matches(pattern, r, full, name))
+				continue;
+
+			pthread_mutex_lock(&state->lock);
+			strlist_append(&pattern->results, full);
+			pthread_mutex_unlock(&state->lock);
+		}
+	}
+
+	free(full);
+}
+
+static void push_dir(struct walk_state *state, char *path, size_t root)
+{
+	pthread_mutex_lock(&state->lock);
+
+	size_t space = state->stack.space;
+
+	/* The roots grow with the space of the stack. */
+	strlist_append(&state->stack, path);
+	if (state->stack.space != space || !state->stack_roots) {
+		state->stack_roots = realloc(state->stack_roots, sizeof(size_t)
+				* state->stack.space);
+	}
+
+	state->stack_roots[state->stack.size - 1] = root;
+
+	pthread_cond_signal(&state->cond);
+	pthread_mutex_unlock(&state->lock);
+}
+
+static bool pattern_matches(struct walk_pattern *pattern, struct walk_root *r,
+		char *path, char *name)
+{
+	size_t len;
+
+	if (pattern->glob)
+		return glob_match(pattern->glob, path);
+
+	/* The name matches in any directory below the one of the pattern. */
+	len = strlen(pattern->dir);
+	if (strcmp(pattern->dir, r->path)
+			&& (strncmp(path, pattern->dir, len) || path[len] != '/'))
+		return false;
+
+	return !fnmatch(pattern->name, name, 0);
+}
+
+static bool skip_dir(struct walk_state *state, size_t root, char *path)
+{
+	struct walk_root *r = &state->roots[root];
+
+	if (state->exclude && globset_match_dir(state->exclude, path))
+		return true;
+
+	/* Only enter it if any pattern can match something below it. */
+	for (size_t i = 0; i < r->npatterns; i++) {
+		if (!r->patterns[i]->glob
+				|| glob_match_below(r->patterns[i]->glob, path))
+			return false;
+	}
+
+	return true;
+}
+
+static char *normalize_dir(char *dir)
+{
+	char *p = dir;
+	size_t len;
+
+	while (p[0] == '.' && p[1] == '/')
+		p += 2;
+
+	p = strdup(*p ? p : ".");
+	len = strlen(p);
+	while (len > 1 && p[len - 1] == '/')
+		p[--len] = 0;
+
+	free(dir);
+	return p;
+}
+
+static bool dir_contains(char *outer, char *inner)
+{
+	size_t len = strlen(outer);
+
+	if (!strcmp(outer, "."))
+		return *inner != '/' && strncmp(inner, "..", 2);
+
+	return !strncmp(outer, inner, len)
+		&& (inner[len] == '/' || inner[len] == 0);
+}
+
+static int cmp_str(const void *a, const void *b)
+{
+	return strcmp(* (char **) a, * (char **) b);
+}
@@ -0,0 +1,293 @@
+/*
+ * watch.c - rebuilding when files change
+ * Copyright (c) 2022 mini-rose
+ */
+
+#include "build.h"
+#include <dirent.h>
+#include <poll.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+
+
+/* In watch mode, build stays running after the first build, with the parsed
+   buildfile & the expanded sources in memory. The directories of all sources
+   and the headers they included last time, as recorded in the state files,
+   are watched with inotify, so an edit only costs checking the state files &
+   compiling what changed. Directories are watched instead of the files,
+   because most editors save by replacing the file.
+
+   The buildfile is parsed again when it changes, and so are the wildcards
+   when a source is added or removed. */
+
+/* How long to wait for more events after the first one, in ms. An editor
+   saving a file causes a couple of them. */
+#define WATCH_SETTLE    20
+
+/* The name of a watched file, and what a change to it means. */
+#define WATCH_INPUT     1
+#define WATCH_SOURCE    2
+
+struct watch
+{
+	int fd;
+	int rootwd;                     /* watching ".", with the buildfile */
+	struct strmap names;            /* basename -> WATCH_* */
+	struct strmap dirs;             /* watched directories */
+};
+
+/* Watch the sources & inputs of all outputs, in all variants. */
+static void watch_inputs(struct watch *w, struct config *config);
+static void watch_outputs(struct watch *w, struct config *config);
+static void watch_output(struct watch *w, struct config *config);
+static void watch_file(struct watch *w, char *path, uint64_t kind);
+
+/* Wait for changes. Returns true if the buildfile or the set of sources
+   changed, so the buildfile has to be parsed again. */
+static bool wait_changes(struct watch *w, struct config *config);
+
+/* Parse the buildfile again, keeping the options from the command line.
+   Returns 1 if it cannot be parsed. */
+static int reload(struct config *config);
+
+static bool is_source(char *name);
+
+
+int watch(struct config *config)
+{
+	struct watch w = {0};
+	double started;
+	bool rescan;
+
+	w.fd = inotify_init1(IN_CLOEXEC);
+	if (w.fd == -1) {
+		perror("build: cannot watch for changes");
+		return 1;
+	}
+
+	compile(config);
+
+	while (1) {
+		watch_inputs(&w, config);
+		printf("build: watching %zu directories for changes\n",
+				w.dirs.used);
+		fflush(stdout);
+
+		rescan = wait_changes(&w, config);
+		started = clock_now();
+
+		if (rescan && reload(config)) {
+			fprintf(stderr, "build: %s not found\n", config->buildfile);
+			continue;
+		}
+
+		compile(config);
+		printf("build: rebuilt in %.0f ms\n", (clock_now() - started) * 1000);
+	}
+
+	return 0;
+}
+
+static void watch_inputs(struct watch *w, struct config *config)
+{
+	struct config variant;
+
+	/* The files to watch may have changed with the last build, so start
+	   over. Watching a directory twice returns the same descriptor. */
+	strmap_free(&w->names);
+	strmap_free(&w->dirs);
+
+	w->rootwd = inotify_add_watch(w->fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO
+			| IN_MOVED_FROM | IN_CREATE | IN_DELETE);
+	strmap_set(&w->dirs, ".", 1);
+	strmap_set(&w->names, config->buildfile, WATCH_SOURCE);
+
+	if (!config->nvariants)
+		watch_outputs(w, config);
+
+	for (size_t i = 0; i < config->nvariants; i++) {
+		config_variant(config, config->variants[i], &variant);
+		watch_outputs(w, &variant);
+		config_artifact_free(&variant);
+	}
+
+	if (config->pch)
+		watch_file(w, config->pch, WATCH_INPUT);
+}
+
+static void watch_outputs(struct watch *w, struct config *config)
+{
+	struct config output;
+
+	if (config->sources.size || !config->nartifacts) {
+		config_artifact(config, NULL, &output);
+		watch_output(w, &output);
+		config_artifact_free(&output);
+	}
+
+	for (size_t i = 0; i < config->nartifacts; i++) {
+		config_artifact(config, config->artifacts[i], &output);
+		watch_output(w, &output);
+		config_artifact_free(&output);
+	}
+}
+
+static void watch_output(struct watch *w, struct config *config)
+{
+	struct objstate state;
+	struct dirent *ent;
+	size_t len, dirlen;
+	char *statepath;
+	DIR *dir;
+
+	for (size_t i = 0; i < config->sources.size; i++)
+		watch_file(w, config->sources.strs[i], WATCH_SOURCE);
+
+	/* Read all state files, as with unity batches, they are not named
+	   after the sources. The .link file is skipped, as the output is no
+	   input of the build. */
+	dir = opendir(config->builddir);
+	if (!dir)
+		return;
+
+	dirlen = strlen(config->builddir);
+	while ((ent = readdir(dir))) {
+		len = strlen(ent->d_name);
+		if (len < 6 || strcmp(ent->d_name + len - 6, ".state"))
+			continue;
+
+		statepath = malloc(dirlen + len + 2);
+		sprintf(statepath, "%s/%s", config->builddir, ent->d_name);
+		if (!objstate_load(&state, statepath)) {
+			for (size_t j = 0; j < state.inputs.size; j++) {
+				/* Generated files change with every build. */
+				if (!strncmp(state.inputs.strs[j], config->builddir, dirlen)
+						&& state.inputs.strs[j][dirlen] == '/')
+					continue;
+				watch_file(w, state.inputs.strs[j], WATCH_INPUT);
+			}
+			objstate_free(&state);
+		}
+		free(statepath);
+	}
+
+	closedir(dir);
+}
+
+static void watch_file(struct watch *w, char *path, uint64_t kind)
+{
+	char *slash, *dir;
+	uint64_t old;
+
+	slash = strrchr(path, '/');
+	if (!strmap_get(&w->names, slash ? slash + 1 : path, &old) || old < kind)
+		strmap_set(&w->names, slash ? slash + 1 : path, kind);
+
+	if (!slash)
+		return;
+
+	dir = strndup(path, slash - path);
+	if (!strmap_get(&w->dirs, dir, &old)) {
+		if (inotify_add_watch(w->fd, *dir ? dir : "/", IN_CLOSE_WRITE
+					| IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE
+					| IN_DELETE) == -1 && errno != ENOENT) {
+			fprintf(stderr, "build: cannot watch %s\n", dir);
+		}
+		strmap_set(&w->dirs, dir, 1);
+	}
+
+	free(dir);
+}
+
+static bool wait_changes(struct watch *w, struct config *config)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	struct pollfd pfd = { .fd = w->fd, .events = POLLIN };
+	bool changed = false, rescan = false;
+	uint64_t kind;
+	ssize_t len;
+
+	/* Block until the first relevant event, then take everything that
+	   comes in shortly after it. */
+	while (poll(&pfd, 1, changed ? WATCH_SETTLE : -1) != 0) {
+		len = read(w->fd, buf, sizeof(buf));
+		if (len <= 0) {
+			if (len == -1 && errno == EINTR)
+				continue;
+			break;
+		}
+
+		for (char *p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *) p;
+			if (!ev->len)
+				continue;
+
+			if (!strmap_get(&w->names, ev->name, &kind)) {
+				/* A new source may match a wildcard. */
+				if (ev->mask & (IN_CREATE | IN_MOVED_TO)
+						&& is_source(ev->name)) {
+					changed = rescan = true;
+				}
+				continue;
+			}
+
+			if (config->explain)
+				printf("changed: %s\n", ev->name);
+			changed = true;
+
+			if (kind == WATCH_SOURCE && (ev->mask & (IN_DELETE
+							| IN_MOVED_FROM)))
+				rescan = true;
+			if (ev->wd == w->rootwd && !strcmp(ev->name, config->buildfile))
+				rescan = true;
+		}
+	}
+
+	return rescan;
+}
+
+static int reload(struct config *config)
+{
+	struct config fresh = {0};
+
+	fresh.buildfile = strdup(config->buildfile);
+	fresh.explain = config->explain;
+	fresh.use_n_threads = config->use_n_threads;
+	fresh.njobs = config->njobs;
+	fresh.limits = config->limits;
+	for (size_t i = 0; i < config->called_variants.size; i++)
+		strlist_append(&fresh.called_variants,
+				config->called_variants.strs[i]);
+
+	if (parse_buildfile(&fresh)) {
+		config_free(&fresh);
+		return 1;
+	}
+
+	config_free(config);
+	*config = fresh;
+	return 0;
+}
+
+static bool is_source(char *name)
+{
+	char *ext = strrchr(name, '.');
+
+	return ext && (!strcmp(ext, ".c") || !strcmp(ext, ".cc")
+			|| !strcmp(ext, ".cpp"));
+}
+
+#else
+
+int watch(struct config *config)
+{
+	(void) config;
+	fputs("build: watch mode needs inotify, which is only on Linux\n",
+			stderr);
+	return 1;
+}
+
+#endif
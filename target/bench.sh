@@ -0,0 +1,92 @@
+#!/bin/sh
+# Benchmark the job scheduler on a skewed workload.
+#
+# Generates a project where a few sources are much slower to compile than the
+# rest, and builds it with a stub compiler which only sleeps. The measured
+# makespan is compared with the makespan the old static split (a contiguous
+# range of sources per thread) would have had for the same costs.
+#
+# usage: sh target/bench.sh [-j jobs] [-n sources] [-k heavy] [build binary]
+
+JOBS=4
+NSRC=32
+NHEAVY=4
+HEAVY=1.0
+LIGHT=0.05
+
+while getopts j:n:k: opt; do
+    case $opt in
+        j) JOBS=$OPTARG;;
+        n) NSRC=$OPTARG;;
+        k) NHEAVY=$OPTARG;;
+        *) exit 1;;
+    esac
+done
+shift $((OPTIND - 1))
+
+BUILD=$(realpath "${1:-./target/build}")
+[ -x "$BUILD" ] || {
+    echo "bench: $BUILD not found, run a regular \`build\` first"
+    exit 1
+}
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# The stub compiler sleeps for the cost in the first line of the source and
+# creates the output file.
+cat > "$DIR/stubcc" <<'STUB'
+#!/bin/sh
+out=; src=
+while [ $# -gt 0 ]; do
+    case "$1" in
+        -o) out=$2; shift;;
+        *.c) src=$1;;
+    esac
+    shift
+done
+[ -n "$src" ] && sleep "$(head -n 1 "$src" | cut -d ' ' -f 2)"
+[ -n "$out" ] && : > "$out"
+exit 0
+STUB
+chmod +x "$DIR/stubcc"
+
+mkdir "$DIR/src"
+i=0
+while [ $i -lt "$NSRC" ]; do
+    cost=$LIGHT
+    [ $i -lt "$NHEAVY" ] && cost=$HEAVY
+    printf '/* %s */\n' "$cost" > "$DIR/src/$(printf 'f%05d' $i).c"
+    i=$((i + 1))
+done
+
+printf 'cc %s\nsrc src/*.c\nout prog\n' "$DIR/stubcc" > "$DIR/buildfile"
+
+start=$(date +%s.%N)
+"$BUILD" -f "$DIR/buildfile" -j "$JOBS" > /dev/null || exit 1
+end=$(date +%s.%N)
+
+# Replay the old split_tasks() ranges over the same costs.
+for f in "$DIR"/src/*.c; do head -n 1 "$f" | cut -d ' ' -f 2; done | awk \
+    -v jobs="$JOBS" -v start="$start" -v end="$end" '
+    { cost[NR - 1] = $1; total += $1 }
+    END {
+        n = NR
+        per = int(n / jobs); left = n % jobs; index_ = 0; static = 0
+        for (t = 0; t < jobs && t < n; t++) {
+            amount = per + (t < left)
+            sum = 0
+            for (i = index_; i < index_ + amount; i++)
+                sum += cost[i]
+            index_ += amount
+            if (sum > static)
+                static = sum
+        }
+        ideal = total / jobs
+        actual = end - start
+        printf "sources:          %d (-j %d)\n", n, jobs
+        printf "total cost:       %.2fs\n", total
+        printf "lower bound:      %.2fs\n", ideal
+        printf "static split:     %.2fs (idle tail %.2fs)\n", static, static - ideal
+        printf "job queue:        %.2fs (idle tail %.2fs)\n", actual, actual - ideal
+    }'
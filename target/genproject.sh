@@ -0,0 +1,135 @@
+#!/bin/sh
+# Generate a synthetic project for benchmarking the build tool itself.
+#
+# Writes `n` tiny C sources below dir/src and a buildfile for them. The
+# sources are spread over a tree of directories `depth` levels deep with
+# `width` directories on each level, or all in src/ with a depth of 0.
+#
+#   -n files     amount of sources (default: 1000)
+#   -d depth     levels of directories (default: 0)
+#   -w width     directories on each level (default: 4)
+#   -x excludes  amount of excludes in the src option (default: 0)
+#   -t targets   amount of @targets, which all run from @t0 (default: 0)
+#   -l           list every source in src, instead of a wildcard
+#   -c cc        compiler for the buildfile (default: cc)
+#
+# usage: sh target/genproject.sh [-n files] [-d depth] [-w width]
+#            [-x excludes] [-t targets] [-l] [-c cc] dir
+
+NFILES=1000
+DEPTH=0
+WIDTH=4
+NEXCLUDE=0
+NTARGETS=0
+LIST=0
+CC=cc
+
+while getopts n:d:w:x:t:lc: opt; do
+    case $opt in
+        n) NFILES=$OPTARG;;
+        d) DEPTH=$OPTARG;;
+        w) WIDTH=$OPTARG;;
+        x) NEXCLUDE=$OPTARG;;
+        t) NTARGETS=$OPTARG;;
+        l) LIST=1;;
+        c) CC=$OPTARG;;
+        *) exit 1;;
+    esac
+done
+shift $((OPTIND - 1))
+
+DIR=$1
+[ -n "$DIR" ] || {
+    echo 'genproject: missing the directory'
+    exit 1
+}
+
+mkdir -p "$DIR/src" && cd "$DIR" || exit 1
+
+# The path of every source, one per line. Source i goes into the directory
+# given by the digits of i in base `width`, so all leaves get about as many.
+awk -v n="$NFILES" -v depth="$DEPTH" -v width="$WIDTH" 'BEGIN {
+    for (i = 0; i < n; i++) {
+        path = "src"
+        k = i
+        for (l = 0; l < depth; l++) {
+            path = path "/d" (k % width)
+            k = int(k / width)
+        }
+        printf "%s/f%06d.c\n", path, i
+    }
+}' > sources.txt
+
+sed 's,/[^/]*$,,' sources.txt | sort -u | xargs mkdir -p
+
+awk '{
+    name = $0
+    sub(/.*\//, "", name)
+    sub(/\.c$/, "", name)
+    printf("int %s(void) { return %d; }\n", name, NR) > $0
+    close($0)
+}' sources.txt
+
+# The sources are split over several src lines, because a line of the
+# buildfile has a maximum length.
+{
+    printf '# Generated by target/genproject.sh\n\n'
+    printf 'cc          %s\n' "$CC"
+    printf 'out         prog\n'
+    printf 'flags       -O2\n'
+
+    if [ "$LIST" = 1 ]; then
+        awk '{ printf "%s%s", (NR % 40 == 1 ? "src        " : ""), " " $0 }
+            NR % 40 == 0 { print "" }
+            END { if (NR % 40) print "" }' sources.txt
+    elif [ "$DEPTH" -gt 0 ]; then
+        printf 'src         src/**/*.c\n'
+    else
+        printf 'src         src/*.c\n'
+    fi
+
+    # Mostly single files, like the usual list of broken sources, with a
+    # directory and a wildcard.
+    if [ "$NEXCLUDE" -gt 0 ]; then
+        awk -v n="$NEXCLUDE" -v depth="$DEPTH" '
+            BEGIN { step = 1 }
+            { path[NR] = $0 }
+            END {
+                plain = n
+                if (depth > 0 && plain > 1) plain--
+                if (plain > 1) plain--
+                if (plain > NR) plain = NR
+                step = plain ? int(NR / plain) : 1
+                if (step < 1) step = 1
+                k = 0
+                for (i = step; i <= NR && k < plain; i += step)
+                    excl[k++] = "!" path[i]
+                if (n > 1)
+                    excl[k++] = "!src/**/f*99.c"
+                if (depth > 0 && n > 1)
+                    excl[k++] = "!src/d1/"
+                for (i = 0; i < k; i++) {
+                    if (i % 40 == 0) printf "%ssrc        ", (i ? "\n" : "")
+                    printf " %s", excl[i]
+                }
+                if (k) print ""
+            }' sources.txt
+    fi
+
+    # A binary tree of targets, so building @t0 runs all of them.
+    if [ "$NTARGETS" -gt 0 ]; then
+        printf '\n'
+        awk -v n="$NTARGETS" 'BEGIN {
+            for (i = 0; i < n; i++) {
+                if (2 * i + 2 < n)
+                    printf "@t%d: t%d t%d\n    :\n", i, 2 * i + 1, 2 * i + 2
+                else if (2 * i + 1 < n)
+                    printf "@t%d: t%d\n    :\n", i, 2 * i + 1
+                else
+                    printf "@t%d    :\n", i
+            }
+        }'
+    fi
+} > buildfile
+
+rm -f sources.txt
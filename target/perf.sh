@@ -0,0 +1,168 @@
+#!/bin/sh
+# Benchmark the overhead of the build tool itself.
+#
+# Generates synthetic projects with target/genproject.sh and builds them
+# with a stub compiler, which only creates the output file, so the times are
+# those of the build tool and not of the compiler. For each project, it
+# measures:
+#
+#   parse_cold   parsing the buildfile & expanding the wildcards
+#   expand       expanding the wildcards, part of parse_cold
+#   parse_warm   parsing the buildfile again, from the snapshot
+#   full         a full build, from start to exit
+#   schedule     checking which sources to compile, part of full
+#   jobs         from the first compile to the end of the last one
+#   noop         a build with nothing to do, from start to exit
+#   targets      running all @targets (only the targets project)
+#
+# The times are in ms, from the trace of each build, except for full, noop &
+# targets, which include starting & exiting. They are written as
+# JSON to stdout, or to `file` with -o, for comparing them across commits.
+#
+# usage: sh target/perf.sh [-j jobs] [-n "sizes"] [-o file] [build binary]
+
+JOBS=$(nproc 2>/dev/null || echo 4)
+SIZES="1000 10000"
+OUT=
+
+while getopts j:n:o: opt; do
+    case $opt in
+        j) JOBS=$OPTARG;;
+        n) SIZES=$OPTARG;;
+        o) OUT=$OPTARG;;
+        *) exit 1;;
+    esac
+done
+shift $((OPTIND - 1))
+
+BUILD=$(realpath "${1:-./target/build}")
+[ -x "$BUILD" ] || {
+    echo "perf: $BUILD not found, run a regular \`build\` first" >&2
+    exit 1
+}
+
+GEN=$(realpath "$(dirname "$0")/genproject.sh")
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# Compile the stub, so starting it costs as little as possible.
+cat > "$DIR/stubcc.c" <<'STUB'
+#include <stdio.h>
+#include <string.h>
+
+int main(int argc, char **argv)
+{
+	FILE *f;
+
+	for (int i = 1; i + 1 < argc; i++) {
+		if (strcmp(argv[i], "-o"))
+			continue;
+		if (!(f = fopen(argv[i + 1], "w")))
+			return 1;
+		fclose(f);
+	}
+	return 0;
+}
+STUB
+${CC:-cc} -O2 -o "$DIR/stubcc" "$DIR/stubcc.c" || exit 1
+
+now() {
+    date +%s.%N
+}
+
+# The total duration of the spans with the name, or with a category instead,
+# the time from the start of its first span to the end of its last one, in ms.
+span() {
+    awk -v key="$1" -v cat="$2" '
+        /"ph":"X"/ {
+            if (cat != "" ? !index($0, "\"cat\":\"" cat "\"") \
+                    : index($0, "{\"name\":\"" key "\"") != 1)
+                next
+            match($0, /"ts":[0-9]+/)
+            ts = substr($0, RSTART + 5, RLENGTH - 5) + 0
+            match($0, /"dur":[0-9]+/)
+            dur = substr($0, RSTART + 6, RLENGTH - 6) + 0
+            if (cat == "") {
+                total += dur
+            } else {
+                if (!n++ || ts < first) first = ts
+                if (ts + dur > last) last = ts + dur
+            }
+        }
+        END {
+            if (cat != "") total = last - first
+            printf "%.2f", total / 1000
+        }' "$3"
+}
+
+ms() {
+    awk -v a="$1" -v b="$2" 'BEGIN { printf "%.2f", (b - a) * 1000 }'
+}
+
+# Build the project in $1 with the rest of the arguments, and leave the
+# trace in $1/trace.json. Prints the wall time in ms.
+run() {
+    proj=$1
+    shift
+    start=$(now)
+    "$BUILD" -f "$proj/buildfile" -t "$proj/trace.json" "$@" > /dev/null \
+        || echo "perf: build failed in $proj" >&2
+    ms "$start" "$(now)"
+}
+
+bench() {
+    name=$1
+    files=$2
+    shift 2
+    proj=$DIR/$name-$files
+
+    sh "$GEN" -n "$files" -c "$DIR/stubcc" "$@" "$proj" || exit 1
+
+    run "$proj" -s > /dev/null
+    parse_cold=$(span parse_buildfile "" "$proj/trace.json")
+    expand=$(span expand_wildcards "" "$proj/trace.json")
+
+    run "$proj" -s > /dev/null
+    parse_warm=$(span parse_buildfile "" "$proj/trace.json")
+
+    full=$(run "$proj" -j "$JOBS")
+    schedule=$(span check "" "$proj/trace.json")
+    jobs=$(span "" compile "$proj/trace.json")
+
+    noop=$(run "$proj" -j "$JOBS")
+
+    targets=null
+    case " $* " in
+        *" -t "*) targets=$(run "$proj" -j "$JOBS" t0);;
+    esac
+
+    [ "$first" ] || printf ',\n'
+    first=
+    printf '    {"project": "%s", "files": %d, "parse_cold": %s, ' \
+        "$name" "$files" "$parse_cold"
+    printf '"expand": %s, "parse_warm": %s, "full": %s, "schedule": %s, ' \
+        "$expand" "$parse_warm" "$full" "$schedule"
+    printf '"jobs": %s, "noop": %s, "targets": %s}' "$jobs" "$noop" \
+        "$targets"
+
+    rm -rf "$proj"
+}
+
+commit=$(git -C "$(dirname "$0")" rev-parse --short HEAD 2>/dev/null)
+
+{
+    printf '{\n  "commit": "%s",\n  "version": %s,\n  "jobs": %d,\n' \
+        "$commit" "$("$BUILD" -v)" "$JOBS"
+    printf '  "results": [\n'
+
+    first=1
+    for n in $SIZES; do
+        bench flat "$n" -d 0
+        bench deep "$n" -d 8 -w 2
+        bench list "$n" -d 2 -l
+        bench excludes "$n" -d 3 -x "$((n / 10))"
+        bench targets "$n" -d 2 -t 1000
+    done
+
+    printf '\n  ]\n}\n'
+} > "${OUT:-/dev/stdout}"